@@ -66,10 +66,122 @@ IO_API int io_loop_start(io_loop_t** loop);
 IO_API int io_loop_stop(io_loop_t* loop);
 IO_API int io_loop_ref(io_loop_t* loop);
 IO_API int io_loop_unref(io_loop_t* loop);
+typedef struct io_loop_post_options_t {
+    size_t stack_size;  // bytes, 0 uses default
+    int stealable;      // another loop of the group may run it
+} io_loop_post_options_t;
+
 IO_API int io_loop_post(io_loop_t* loop, io_loop_fn entry, void* arg);
+// Posts run on the given loop unless stealable is set. Only set it when
+// the entry and arg use nothing bound to that loop: a stream attached
+// there, or its timers, must not be touched from a sibling
+IO_API int io_loop_post_ex(io_loop_t* loop, io_loop_fn entry, void* arg, const io_loop_post_options_t* options);
+typedef struct io_loop_job_t {
+    io_loop_fn entry;
+    void* arg;
+} io_loop_job_t;
+
+// Posts all jobs or none, with a single queue exchange and wakeup
+IO_API int io_loop_post_batch(io_loop_t* loop, const io_loop_job_t* jobs, size_t count);
 IO_API int io_loop_exec(io_loop_t* loop, io_loop_fn entry, void* arg);
 IO_API int io_loop_sleep(uint64_t milliseconds);
 IO_API int io_loop_idle(io_loop_t* loop, uint64_t milliseconds);
+// Keeps up to limit finished tasks with their stacks for reuse, stacks
+// left unused for trim_milliseconds are released to the OS (0 disables)
+IO_API int io_loop_set_task_cache(io_loop_t* loop, size_t limit, uint64_t trim_milliseconds);
+// Default stack size of the loop's new tasks, rounded up to pages (1 MiB
+// initially), applied on the loop thread
+IO_API int io_loop_set_stack_size(io_loop_t* loop, size_t size);
+// Deepest stack use of finished tasks, ENOTSUP in release builds
+IO_API int io_loop_stack_usage(io_loop_t* loop, size_t* high_water);
+// Upper bound of events taken per wait, the batch grows while it comes back full
+IO_API int io_loop_set_max_events(io_loop_t* loop, size_t max_events);
+// Polls for events this long before blocking, also sets SO_BUSY_POLL on sockets
+IO_API int io_loop_set_busy_poll(io_loop_t* loop, uint64_t microseconds);
+// Pins the loop thread to a processor, memory the loop allocates afterwards
+// is first touched there and so NUMA local. Reuseport listeners of a pinned
+// loop prefer connections whose packets arrive on that processor
+IO_API int io_loop_set_affinity(io_loop_t* loop, int cpu);
+
+// Loops of a group steal stealable posts not started yet from busy siblings,
+// count 0 starts one pinned loop per processor
+typedef struct io_loop_group_t io_loop_group_t;
+
+IO_API int io_loop_group_start(io_loop_group_t** group, size_t count);
+IO_API int io_loop_group_stop(io_loop_group_t* group);
+IO_API size_t io_loop_group_size(io_loop_group_t* group);
+IO_API io_loop_t* io_loop_group_get(io_loop_group_t* group, size_t index);
+// Tasks this loop took from siblings and siblings took from it
+IO_API int io_loop_steal_stats(io_loop_t* loop, uint64_t* steals, uint64_t* stolen);
+
+
+// Stats
+
+typedef struct io_counter_t {
+    uint64_t count;
+    uint64_t nanoseconds;   // time spent, where measured
+    double rate;            // count per second over the period
+} io_counter_t;
+
+typedef struct io_stats_t {
+    uint64_t period;        // milliseconds since previous io_stats_get of the loop
+    io_counter_t loop_iteration;   // loop iterations
+    io_counter_t loop_idle;        // blocking waits, time blocked
+    io_counter_t loop_post;        // posted tasks started
+    io_counter_t task_swapcontext; // context switches
+    io_counter_t memory_alloc;     // tasks and streams allocated for the loop
+    io_counter_t memory_free;      // and released
+    io_counter_t file_open;        // opens, time until opened
+    io_counter_t file_create;      // opens with IO_FILE_CREATE
+    io_counter_t file_read;        // reads, time spent
+    io_counter_t file_write;       // writes, time spent
+    io_counter_t tcp_connect;      // connects, time until connected
+    io_counter_t tcp_accept;       // accepted connections
+    io_counter_t tcp_accept_retry; // accepts delayed by descriptor or memory exhaustion
+    io_counter_t tcp_read;         // reads, time spent
+    io_counter_t tcp_write;        // writes, time spent
+    io_counter_t threadpool_post;  // blocking calls offloaded
+    io_counter_t event_wait;
+    io_counter_t event_notify;
+} io_stats_t;
+
+// Snapshot of loop counters, totals since the loop started and rates since
+// previous call for the same loop. Call on the loop thread, from elsewhere
+// through io_loop_exec, EINVAL otherwise
+IO_API int io_stats_get(io_loop_t* loop, io_stats_t* stats);
+
+typedef enum io_latency_type_t {
+    IO_LATENCY_READ,        // stream reads, time until data, eof or failure
+    IO_LATENCY_WRITE,       // stream writes, time until written
+    IO_LATENCY_ACCEPT,      // accept calls, time until connected, loops only
+    IO_LATENCY_SCHEDULE     // posted tasks, time from post to first run, loops only
+} io_latency_type_t;
+
+// Nanoseconds within which percentile (0-100) of the operations completed,
+// known within 12.5%, 0 before any. Loops aggregate all their streams.
+// ENOTSUP for reads and writes when built with IO_STREAM_TIMING=0
+IO_API int io_loop_latency(io_loop_t* loop, io_latency_type_t type,
+                           double percentile, uint64_t* nanoseconds);
+// Starts a new measurement window, call on the loop thread
+IO_API int io_loop_latency_reset(io_loop_t* loop);
+
+
+// Watchdog
+
+typedef struct io_stall_t {
+    io_loop_t* loop;
+    uint64_t milliseconds;  // since the loop last returned from waiting for events
+    io_loop_fn entry;       // task running when seen, 0 for the loop itself
+    void* arg;
+} io_stall_t;
+
+typedef void(*io_watchdog_fn)(const io_stall_t* stall, void* arg);
+
+// Reports loops not returning to wait for events within threshold
+// milliseconds, once per stall, on the watchdog thread. The loop may have
+// stopped meanwhile. Stop waits for a report in progress, do not call it there
+IO_API int io_watchdog_start(uint64_t threshold, io_watchdog_fn fn, void* arg);
+IO_API int io_watchdog_stop();
 
 
 // Event
@@ -111,24 +223,57 @@ typedef struct io_stream_info_t {
         uint64_t bytes;         // total bytes
         uint64_t period;        // total nanoseconds
         uint64_t position;
+        uint64_t count;         // total operations
+        uint64_t fast;          // operations completed without suspending
     } read;
     struct {
         uint64_t timeout;       // milliseconds
         uint64_t bytes;         // total bytes
         uint64_t period;        // total nanoseconds
         uint64_t position;
+        uint64_t count;         // total operations
+        uint64_t fast;          // operations completed without suspending
     } write;
     void* data;
 } io_stream_info_t;
 
 typedef struct io_stream_t io_stream_t;
 
+typedef struct io_iovec_t {
+    char* buffer;
+    size_t length;
+} io_iovec_t;
+
 IO_API int io_stream_create(io_stream_t** stream); // Creates a memory stream
 IO_API int io_stream_close(io_stream_t* stream);
 IO_API int io_stream_info(io_stream_t* stream, io_stream_info_t** info);
+// Read and write latency of this stream, see io_loop_latency
+IO_API int io_stream_latency(io_stream_t* stream, io_latency_type_t type,
+                             double percentile, uint64_t* nanoseconds);
 IO_API size_t io_stream_read(io_stream_t* stream, char* buffer, size_t length, int exact);
 IO_API size_t io_stream_unread(io_stream_t* stream, const char* buffer, size_t length);
 IO_API size_t io_stream_write(io_stream_t* stream, const char* buffer, size_t length);
+// Scatter/gather with one syscall where the backend allows. Readv returns what
+// is available like read, writev writes all of the vectors or fails
+IO_API size_t io_stream_readv(io_stream_t* stream, const io_iovec_t* vectors, size_t count);
+IO_API size_t io_stream_writev(io_stream_t* stream, const io_iovec_t* vectors, size_t count);
+// Corked streams gather small writes in a loop buffer, sent as one write when
+// it fills, before reads, on io_stream_flush and on close
+IO_API int io_stream_set_cork(io_stream_t* stream, int enabled);
+IO_API int io_stream_flush(io_stream_t* stream);
+// Buffered bytes without copying them, vectors stay valid until the bytes are
+// consumed or read. Other than memory streams read once when nothing is
+// buffered. Returns the number of vectors filled
+IO_API size_t io_stream_peek(io_stream_t* stream, io_iovec_t* vectors, size_t count);
+IO_API size_t io_stream_consume(io_stream_t* stream, size_t length);
+// Reads through the end of the delimiter. ENOBUFS when it is not within length
+// bytes, the stream error, ETIMEDOUT or ENODATA when the stream ends first.
+// Bytes not returned stay buffered
+IO_API int io_stream_read_until(io_stream_t* stream, const char* delimiter, size_t delimiter_length,
+                                char* buffer, size_t length, size_t* transferred);
+// Moves up to length bytes between memory streams without copying, EINVAL
+// for other streams or when either has filters
+IO_API int io_stream_splice(io_stream_t* from, io_stream_t* to, size_t length, size_t* moved);
 IO_API int io_stream_pipe(io_stream_t* from, io_stream_t* to, size_t chunk_size, size_t* transferred);
 
 typedef struct io_filter_t {
@@ -138,6 +283,9 @@ typedef struct io_filter_t {
     size_t(*on_read)(struct io_filter_t* filter, char* buffer, size_t length);
     size_t(*on_write)(struct io_filter_t* filter, const char* buffer, size_t length);
     void(*on_status)(struct io_filter_t* filter);
+    // Defaults pass vectors on, or split them when on_read/on_write are replaced
+    size_t(*on_readv)(struct io_filter_t* filter, const io_iovec_t* vectors, size_t count);
+    size_t(*on_writev)(struct io_filter_t* filter, const io_iovec_t* vectors, size_t count);
 } io_filter_t;
 
 IO_API void io_filter_attach(io_filter_t* filter, io_stream_t* stream);
@@ -151,6 +299,8 @@ typedef struct io_tcp_listener_t io_tcp_listener_t;
 IO_API int io_tcp_listen(io_tcp_listener_t** listener, const char* ip, int port, int backlog);
 IO_API int io_tcp_shutdown(io_tcp_listener_t* listener);
 IO_API int io_tcp_accept(io_stream_t** stream, io_tcp_listener_t* listener);
+// Takes up to count queued connections, EAGAIN when none could be taken this time
+IO_API int io_tcp_accept_many(io_tcp_listener_t* listener, io_stream_t** streams, size_t count, size_t* accepted);
 IO_API int io_tcp_connect(io_stream_t** stream, const char* ip, int port, uint64_t timeout);
 
 
@@ -195,6 +345,10 @@ IO_API int io_directory_enum_delete(io_directory_enum_t* enm);
 
 
 IO_API int io_run(io_loop_fn entry, void* arg);
+// Runs loops (0 means one pinned per processor) each accepting on its own
+// SO_REUSEPORT listener, on_connection receives accepted stream as arg
+// and owns it, returns when any loop stops
+IO_API int io_tcp_serve(const char* ip, int port, int backlog, size_t loops, io_loop_fn on_connection);
 
 
 #ifdef __cplusplus
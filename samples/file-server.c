@@ -35,6 +35,11 @@
 #   define strcmp_nocase _stricmp
 #endif
 
+#define HTTP200 \
+  "HTTP/1.1 200 OK\r\n" \
+  "Connection: Keep-Alive\r\n" \
+  "Content-Type: "
+
 #define HTTP404 \
   "HTTP/1.1 404 Not Found\r\n" \
   "Content-Type: text/plain\r\n" \
@@ -82,6 +87,7 @@ int send_headers(io_stream_t* stream, const char* path)
     io_path_info_t info;
     const char* mime = mime_type(path);
     char content_length[50];
+    io_iovec_t vectors[5];
 
     if (0 != io_path_info_get(path, &info) || info.size == 0)
     {
@@ -89,14 +95,20 @@ int send_headers(io_stream_t* stream, const char* path)
         return EFAULT;
     }
 
-    io_stream_write(stream, "HTTP/1.1 200 OK\r\nConnection: Keep-Alive\r\nContent-Type: ", 64);
-    io_stream_write(stream, mime, strlen(mime));
-    io_stream_write(stream, "\r\nContent-Length: ", 18);
-
     sprintf(content_length, "%d", (int)info.size);
 
-    io_stream_write(stream, content_length, strlen(content_length));
-    io_stream_write(stream, "\r\n\r\n", 4);
+    vectors[0].buffer = HTTP200;
+    vectors[0].length = sizeof(HTTP200) - 1;
+    vectors[1].buffer = (char*)mime;
+    vectors[1].length = strlen(mime);
+    vectors[2].buffer = "\r\nContent-Length: ";
+    vectors[2].length = sizeof("\r\nContent-Length: ") - 1;
+    vectors[3].buffer = content_length;
+    vectors[3].length = strlen(content_length);
+    vectors[4].buffer = "\r\n\r\n";
+    vectors[4].length = sizeof("\r\n\r\n") - 1;
+
+    io_stream_writev(stream, vectors, 5);
 
     return 0;
 }
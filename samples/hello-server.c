@@ -69,35 +69,10 @@ void on_connection(io_loop_t* loop, io_stream_t* stream)
     io_stream_close(stream);
 }
 
-void io_main(io_loop_t* loop, void* arg)
-{
-    int error;
-    io_tcp_listener_t* server;
-    io_stream_t* stream;
-
-    error = io_tcp_listen(&server, "127.0.0.1", 8080, 100);
-    if (error)
-    {
-        printf("%s\r\n", strerror(error));
-        return;
-    }
-
-    while (1)
-    {
-        error = io_tcp_accept(&stream, server);
-        if (error)
-        {
-            printf("%s\r\n", strerror(error));
-            break;
-        }
-
-        io_loop_post(loop, (io_loop_fn)on_connection, stream);
-    }
-}
-
 void main()
 {
-    int error = io_run(io_main, 0);
+    // One loop per processor, each with its own listener on port 8080
+    int error = io_tcp_serve("127.0.0.1", 8080, 100, 0, (io_loop_fn)on_connection);
     if (error)
     {
         printf("%s\r\n", strerror(error));
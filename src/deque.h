@@ -0,0 +1,176 @@
+/* Copyright (c) 2018, Artak Khnkoyan <artak.khnkoyan@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef IO_DEQUE_H_INCLUDED
+#define IO_DEQUE_H_INCLUDED
+
+#include <string.h> // memset
+#include "platform.h"
+#if PLATFORM_WINDOWS
+#   include <intrin.h> // _InterlockedCompareExchange64
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Work-stealing deque of fixed capacity, the owner pushes and pops at the
+ * bottom, other threads steal from the top.
+ * Based on: Chase, Lev "Dynamic circular work-stealing deque" and
+ * Le et al. "Correct and efficient work-stealing for weak memory models"
+ */
+
+#define DEQUE_CAPACITY 256 // power of two
+#define DEQUE_CACHE_LINE 64
+
+typedef struct deque_t {
+    volatile int64_t    top;
+    char                pad0[DEQUE_CACHE_LINE - sizeof(int64_t)];
+    volatile int64_t    bottom;
+    char                pad1[DEQUE_CACHE_LINE - sizeof(int64_t)];
+    void* volatile      items[DEQUE_CAPACITY];
+} deque_t;
+
+#if COMPILER_GCC || COMPILER_CLANG
+
+#   define deque_load_acquire(src)      __atomic_load_n(src, __ATOMIC_ACQUIRE)
+#   define deque_load_relaxed(src)      __atomic_load_n(src, __ATOMIC_RELAXED)
+#   define deque_store_release(dst, v)  __atomic_store_n(dst, v, __ATOMIC_RELEASE)
+#   define deque_store_relaxed(dst, v)  __atomic_store_n(dst, v, __ATOMIC_RELAXED)
+#   define deque_fence()                __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static FORCEINLINE int deque_cas(volatile int64_t* dst, int64_t cmp, int64_t set)
+{
+    return __atomic_compare_exchange_n(dst, &cmp, set, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+#elif PLATFORM_WINDOWS
+
+// Volatile accesses are acquire/release with /volatile:ms
+#   define deque_load_acquire(src)      (*(src))
+#   define deque_load_relaxed(src)      (*(src))
+#   define deque_store_release(dst, v)  (*(dst) = (v))
+#   define deque_store_relaxed(dst, v)  (*(dst) = (v))
+#   define deque_fence()                MemoryBarrier()
+
+static FORCEINLINE int deque_cas(volatile int64_t* dst, int64_t cmp, int64_t set)
+{
+    return _InterlockedCompareExchange64((volatile long long*)dst, set, cmp) == cmp;
+}
+
+#else
+#   error Not implemented
+#endif
+
+static void deque_init(deque_t* deque)
+{
+    memset(deque, 0, sizeof(*deque));
+}
+
+static int64_t deque_size(deque_t* deque)
+{
+    int64_t bottom = deque_load_acquire(&deque->bottom);
+    int64_t top = deque_load_acquire(&deque->top);
+
+    return bottom > top ? bottom - top : 0;
+}
+
+// Owner only, returns 0 when full
+static int deque_push(deque_t* deque, void* item)
+{
+    int64_t bottom = deque_load_relaxed(&deque->bottom);
+    int64_t top = deque_load_acquire(&deque->top);
+
+    if (bottom - top >= DEQUE_CAPACITY)
+    {
+        return 0;
+    }
+
+    deque_store_relaxed(&deque->items[bottom & (DEQUE_CAPACITY - 1)], item);
+    deque_store_release(&deque->bottom, bottom + 1);
+
+    return 1;
+}
+
+// Owner only
+static void* deque_pop(deque_t* deque)
+{
+    int64_t bottom = deque_load_relaxed(&deque->bottom) - 1;
+    int64_t top;
+    void* item = 0;
+
+    deque_store_relaxed(&deque->bottom, bottom);
+    deque_fence();
+    top = deque_load_relaxed(&deque->top);
+
+    if (top <= bottom)
+    {
+        item = deque_load_relaxed(&deque->items[bottom & (DEQUE_CAPACITY - 1)]);
+        if (top == bottom)
+        {
+            // Last item, race against thieves
+            if (!deque_cas(&deque->top, top, top + 1))
+            {
+                item = 0;
+            }
+
+            deque_store_relaxed(&deque->bottom, bottom + 1);
+        }
+    }
+    else
+    {
+        deque_store_relaxed(&deque->bottom, bottom + 1);
+    }
+
+    return item;
+}
+
+// Any thread, returns 0 when empty or lost a race
+static void* deque_steal(deque_t* deque)
+{
+    int64_t top = deque_load_acquire(&deque->top);
+    int64_t bottom;
+    void* item;
+
+    deque_fence();
+    bottom = deque_load_acquire(&deque->bottom);
+
+    if (top >= bottom)
+    {
+        return 0;
+    }
+
+    item = deque_load_relaxed(&deque->items[top & (DEQUE_CAPACITY - 1)]);
+    if (!deque_cas(&deque->top, top, top + 1))
+    {
+        return 0;
+    }
+
+    return item;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // IO_DEQUE_H_INCLUDED
\ No newline at end of file
@@ -254,8 +254,14 @@ int io_event_delete(io_event_t* event)
 
 int io_event_notify(io_event_t* event)
 {
+    io_loop_t* loop = io_loop_current();
     io_event_command_t command;
-    
+
+    if (loop != 0)
+    {
+        counter_increment(&loop->performance.event_notify, 0);
+    }
+
     command.type = IO_EVENT_COMMAND_NOTIFY;
     command.event = event;
 
@@ -264,8 +270,14 @@ int io_event_notify(io_event_t* event)
 
 int io_event_wait(io_event_t* event)
 {
+    io_loop_t* loop = io_loop_current();
     io_event_command_t command;
-    
+
+    if (loop != 0)
+    {
+        counter_increment(&loop->performance.event_wait, 0);
+    }
+
     command.type = IO_EVENT_COMMAND_WAIT;
     command.event = event;
 
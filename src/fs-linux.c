@@ -145,6 +145,7 @@ int io_file_open(io_stream_t** stream, const char* path, io_file_options_t optio
 {
     io_work_t work;
     io_file_req_t open;
+    uint64_t start;
 
     open.path = path;
     open.options = options;
@@ -153,15 +154,21 @@ int io_file_open(io_stream_t** stream, const char* path, io_file_options_t optio
     work.arg = &open;
     work.entry = io_file_open_internal;
 
+    start = PERFORMANCE_MEASURE();
+
     io_threadpool_post(&work);
     task_suspend(work.task);
 
+    counter_increment((options & IO_FILE_CREATE) ? &work.loop->performance.file_create
+                                                 : &work.loop->performance.file_open,
+                      PERFORMANCE_NANOSECONDS(start, PERFORMANCE_MEASURE()));
+
     if (open.error)
     {
         return open.error;
     }
 
-    *stream = io_calloc(1, sizeof(io_stream_t));
+    *stream = io_loop_calloc(work.loop, 1, sizeof(io_stream_t));
     if (*stream == 0)
     {
         return ENOMEM;
@@ -0,0 +1,155 @@
+/* Copyright (c) 2018, Artak Khnkoyan <artak.khnkoyan@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef IO_HISTOGRAM_H_INCLUDED
+#define IO_HISTOGRAM_H_INCLUDED
+
+#include <stdint.h> // uint64_t
+#include <string.h> // memset
+#include "platform.h"
+#if COMPILER_MSVC
+#   include <intrin.h> // _BitScanReverse64
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Latency histogram with log buckets in the manner of HdrHistogram, every
+ * power of two is split into 8 linear sub buckets so any value is known
+ * within 12.5%. Values from 2^34 nanoseconds (about 17 seconds) up share
+ * the last bucket, the exact maximum is kept aside. Written by one thread
+ * with plain increments, readers may see a slightly stale picture
+ */
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BITS 34
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct histogram_t {
+    uint64_t count;
+    uint64_t max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+static FORCEINLINE unsigned histogram_log2(uint64_t value)
+{
+#if COMPILER_GCC || COMPILER_CLANG
+    return 63 - __builtin_clzll(value);
+#elif COMPILER_MSVC && (ARCHITECTURE_X86_64 || ARCHITECTURE_ARM_64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return index;
+#else
+    unsigned log = 0;
+    while (value >>= 1)
+        log++;
+    return log;
+#endif
+}
+
+static FORCEINLINE size_t histogram_index(uint64_t value)
+{
+    unsigned exponent;
+
+    if (value < HISTOGRAM_SUB_COUNT)
+        return (size_t)value;
+
+    if (value >> HISTOGRAM_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+
+    exponent = histogram_log2(value);
+
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT +
+           ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+// Largest value counted in the bucket
+static uint64_t histogram_bucket_limit(size_t index)
+{
+    unsigned shift;
+    uint64_t sub;
+
+    if (index < HISTOGRAM_SUB_COUNT)
+        return index;
+
+    shift = (unsigned)(index / HISTOGRAM_SUB_COUNT) - 1;
+    sub = HISTOGRAM_SUB_COUNT + index % HISTOGRAM_SUB_COUNT;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+static FORCEINLINE void histogram_record(histogram_t* histogram, uint64_t value)
+{
+    histogram->count++;
+    histogram->buckets[histogram_index(value)]++;
+
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+/*
+ * Smallest bucket limit at or under which the percentile (0..100) of
+ * values fall, never more than the recorded maximum
+ */
+static uint64_t histogram_percentile(const histogram_t* histogram, double percentile)
+{
+    uint64_t count = histogram->count;
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t limit;
+    size_t i;
+
+    if (count == 0)
+        return 0;
+
+    if (percentile <= 0)
+        percentile = 0;
+
+    rank = (uint64_t)(count * percentile / 100.0 + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            limit = histogram_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+static void histogram_reset(histogram_t* histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // IO_HISTOGRAM_H_INCLUDED
\ No newline at end of file
@@ -19,8 +19,11 @@
  * IN THE SOFTWARE.
  */
 
+#include <string.h>
 #include "loop.h"
 #include "event.h"
+#include "memory.h"
+#include "thread.h"
 #include "threadpool.h"
 #include "tcp.h"
 
@@ -33,16 +36,34 @@ BOOL WINAPI DllMain(HINSTANCE hDll, DWORD dwReason, LPVOID lpReserved)
 
 #endif
 
-int io_run(io_loop_fn entry, void* arg)
+// Connections taken from the listener per accept call
+#define IO_SERVE_ACCEPT_BATCH 16
+
+// Milliseconds to wait before accepting again after a temporary failure
+#define IO_SERVE_RETRY_DELAY 10
+
+typedef struct io_serve_t {
+    const char* ip;
+    int port;
+    int backlog;
+    io_loop_fn on_connection;
+    io_loop_t** loops;
+    size_t count;
+    size_t running;
+    int error;
+    io_mutex_t mutex;
+    io_condition_t condition;
+} io_serve_t;
+
+static int io_startup()
 {
-	int error;
-	io_loop_t loop;
+    int error;
 
-	error = io_tcp_init();
-	if (error)
-	{
-		return error;
-	}
+    error = io_tcp_init();
+    if (error)
+    {
+        return error;
+    }
 
     error = io_threadpool_init();
     if (error)
@@ -50,29 +71,307 @@ int io_run(io_loop_fn entry, void* arg)
         return error;
     }
 
-	error = io_event_init();
+    error = io_event_init();
+    if (error)
+    {
+        io_threadpool_shutdown();
+        return error;
+    }
+
+    return 0;
+}
+
+static void io_cleanup()
+{
+    io_event_shutdown();
+    io_threadpool_shutdown();
+}
+
+static void io_serve_stop(io_serve_t* serve, int error)
+{
+    size_t i;
+
+    io_mutex_lock(&serve->mutex);
+
+    if (error && !serve->error)
+    {
+        serve->error = error;
+    }
+
+    io_mutex_unlock(&serve->mutex);
+
+    for (i = 0; i < serve->count; ++i)
+    {
+        io_loop_stop(serve->loops[i]);
+    }
+}
+
+// Accept failures which pass once connections are closed
+static int io_serve_retry(int error)
+{
+    switch (error)
+    {
+    case EAGAIN:
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void io_serve_entry(io_loop_t* loop, void* arg)
+{
+    io_serve_t* serve = (io_serve_t*)arg;
+    io_tcp_listener_t* listener;
+    io_stream_t* streams[IO_SERVE_ACCEPT_BATCH];
+    size_t accepted;
+    size_t i;
+    int error;
+
+    if (serve->count == 1)
+    {
+        error = io_tcp_listen(&listener, serve->ip, serve->port, serve->backlog);
+    }
+    else
+    {
+        error = io_tcp_listen_reuseport(&listener, serve->ip, serve->port, serve->backlog);
+    }
+
+    if (error)
+    {
+        io_serve_stop(serve, error);
+        return;
+    }
+
+    while (1)
+    {
+        error = io_tcp_accept_many(listener, streams, IO_SERVE_ACCEPT_BATCH, &accepted);
+        if (io_serve_retry(error))
+        {
+            // Out of descriptors or memory for now, connections wait in the backlog
+            counter_increment(&loop->performance.tcp_accept_retry, 0);
+
+            error = io_loop_sleep(IO_SERVE_RETRY_DELAY);
+            if (error)
+            {
+                break;
+            }
+
+            continue;
+        }
+
+        if (error)
+        {
+            break;
+        }
+
+        for (i = 0; i < accepted; ++i)
+        {
+            if (io_loop_post(loop, serve->on_connection, streams[i]) != 0)
+            {
+                // No task to own the connection
+                io_stream_close(streams[i]);
+            }
+        }
+    }
+
+    io_tcp_shutdown(listener);
+
+    if (error != ECANCELED)
+    {
+        io_serve_stop(serve, error);
+    }
+}
+
+static void io_serve_run(io_loop_t* loop)
+{
+    io_serve_t* serve = (io_serve_t*)loop->arg;
+
+    io_loop_run(loop);
+
+    // One loop is gone, take the others down with it
+    io_serve_stop(serve, 0);
+
+    io_mutex_lock(&serve->mutex);
+    serve->running--;
+    io_condition_signal(&serve->condition);
+    io_mutex_unlock(&serve->mutex);
+}
+
+static IO_THREAD_TYPE io_serve_thread(void* arg)
+{
+    io_serve_run((io_loop_t*)arg);
+
+    return 0;
+}
+
+/*
+ * Public API
+ */
+
+int io_run(io_loop_fn entry, void* arg)
+{
+	int error;
+	io_loop_t* loop;
+
+	error = io_startup();
 	if (error)
 	{
-        io_threadpool_shutdown();
 		return error;
 	}
 
-	error = io_loop_init(&loop);
+	// Released by io_loop_run when the last reference is gone
+	loop = (io_loop_t*)io_malloc(sizeof(io_loop_t));
+	if (loop == 0)
+	{
+		io_cleanup();
+		return ENOMEM;
+	}
+
+	error = io_loop_init(loop);
 	if (error)
 	{
-		io_event_shutdown();
-        io_threadpool_shutdown();
+		io_free(loop);
+		io_cleanup();
 		return error;
 	}
 
-	io_loop_ref(&loop);
+	io_loop_ref(loop);
 
-	loop.entry = entry;
-	loop.arg = arg;
+	loop->entry = entry;
+	loop->arg = arg;
 
-	error = io_loop_run(&loop);
-	io_event_shutdown();
-    io_threadpool_shutdown();
+	error = io_loop_run(loop);
+	io_cleanup();
 
 	return error;
+}
+
+int io_tcp_serve(const char* ip, int port, int backlog, size_t loops, io_loop_fn on_connection)
+{
+    io_serve_t serve;
+    size_t started = 0;
+    size_t i;
+    int pin = 0;
+    int error = 0;
+
+    // One loop per processor, each pinned to its own, including the
+    // current thread which runs the first loop
+    if (loops == 0)
+    {
+        loops = (size_t)io_thread_cpu_count();
+        pin = 1;
+    }
+
+    error = io_startup();
+    if (error)
+    {
+        return error;
+    }
+
+    memset(&serve, 0, sizeof(serve));
+    serve.ip = ip;
+    serve.port = port;
+    serve.backlog = backlog;
+    serve.on_connection = on_connection;
+
+    serve.loops = (io_loop_t**)io_calloc(loops, sizeof(io_loop_t*));
+    if (serve.loops == 0)
+    {
+        io_cleanup();
+        return ENOMEM;
+    }
+
+    for (serve.count = 0; serve.count < loops; ++serve.count)
+    {
+        io_loop_t* loop = (io_loop_t*)io_malloc(sizeof(io_loop_t));
+        if (loop == 0)
+        {
+            error = ENOMEM;
+            break;
+        }
+
+        error = io_loop_init(loop);
+        if (error)
+        {
+            io_free(loop);
+            break;
+        }
+
+        // One reference is released by io_loop_run, one is kept until
+        // all loops are done
+        io_loop_ref(loop);
+        io_loop_ref(loop);
+
+        loop->entry = io_serve_entry;
+        loop->arg = &serve;
+
+        if (pin)
+        {
+            loop->cpu = io_thread_cpu_at((int)serve.count);
+        }
+
+        serve.loops[serve.count] = loop;
+    }
+
+    io_mutex_init(&serve.mutex);
+    io_condition_init(&serve.condition);
+
+    if (!error)
+    {
+        // Current thread runs the first loop
+        serve.running = 1;
+        started = 1;
+
+        for (i = 1; i < serve.count; ++i)
+        {
+            serve.running++;
+
+            error = io_thread_create(io_serve_thread, serve.loops[i]);
+            if (error)
+            {
+                serve.running--;
+                io_serve_stop(&serve, error);
+                break;
+            }
+
+            started++;
+        }
+
+        io_serve_run(serve.loops[0]);
+
+        io_mutex_lock(&serve.mutex);
+        while (serve.running > 0)
+        {
+            io_condition_wait(&serve.condition, &serve.mutex);
+        }
+        io_mutex_unlock(&serve.mutex);
+
+        if (!error)
+        {
+            error = serve.error;
+        }
+    }
+
+    for (i = 0; i < serve.count; ++i)
+    {
+        if (i >= started)
+        {
+            // Never ran, release reference of io_loop_run too
+            io_loop_unref(serve.loops[i]);
+        }
+
+        io_loop_unref(serve.loops[i]);
+    }
+
+    io_condition_destroy(&serve.condition);
+    io_mutex_destroy(&serve.mutex);
+
+    io_free(serve.loops);
+    io_cleanup();
+
+    return error;
 }
\ No newline at end of file
@@ -32,6 +32,11 @@
 #include "time.h"
 #include "loop-linux.h"
 #include "thread.h"
+#include "stopwatch.h"
+#include "watchdog.h"
+
+#define IO_LOOP_EVENTS 64
+#define IO_LOOP_EVENTS_MAX 1024
 
 DECLARE_THREAD_LOCAL(io_loop_t*, loop, 0);
 
@@ -47,15 +52,29 @@ int io_loop_init(io_loop_t* loop)
     memset(loop, 0, sizeof (*loop));
 
     // Init task scheduler
+    loop->cpu = -1;
+    loop->stats_time = time_monotonic();
     loop->current = &loop->main;
     loop->main.loop = loop;
     loop->prev = 0;
 
     // Init loop
+    loop->events_size = IO_LOOP_EVENTS;
+    loop->events_max = IO_LOOP_EVENTS_MAX;
+    loop->splice[0] = -1;
+    loop->splice[1] = -1;
+    loop->events = (struct epoll_event*)io_calloc(loop->events_size, sizeof(struct epoll_event));
+    if (loop->events == 0)
+    {
+        return ENOMEM;
+    }
+
     loop->epoll = epoll_create1(EPOLL_CLOEXEC);
     if (loop->epoll == -1)
     {
-        return errno;
+        error = errno;
+        io_free(loop->events);
+        return error;
     }
 
     // Init wakeup
@@ -64,6 +83,7 @@ int io_loop_init(io_loop_t* loop)
     {
         error = errno;
         io_close(loop->epoll);
+        io_free(loop->events);
         return error;
     }
 
@@ -75,17 +95,41 @@ int io_loop_init(io_loop_t* loop)
     {
         io_close(loop->wakeup.fd);
         io_close(loop->epoll);
+        io_free(loop->events);
         return error;
     }
 
     mpscq_init(&loop->tasks);
+    task_cache_init(&loop->task_cache);
+    io_pool_init(&loop->buffers, IO_LOOP_BUFFER_SIZE, IO_LOOP_BUFFER_LIMIT);
     // mpscq_init(&loop->waiters);
 
+#if IO_USE_URING
+    // Streams fall back to epoll when kernel does not provide io_uring
+    io_uring_init(&loop->uring, loop->wakeup.fd);
+#endif
+
     return 0; 
 }
 
 int io_loop_cleanup(io_loop_t* loop)
 {
+    task_cache_cleanup(&loop->task_cache);
+    io_pool_cleanup(&loop->buffers);
+
+    io_free(loop->events);
+    loop->events = 0;
+
+    if (loop->splice[0] != -1)
+    {
+        io_close(loop->splice[0]);
+        io_close(loop->splice[1]);
+    }
+
+#if IO_USE_URING
+    io_uring_cleanup(&loop->uring);
+#endif
+
     return 0;
 }
 
@@ -107,24 +151,75 @@ io_loop_t* io_loop_current()
     return get_thread_loop();
 }
 
-int io_loop_run(io_loop_t* loop)
+/*
+ * Polls without blocking for up to busy_poll microseconds, but not past
+ * timeout. Returns the number of events, or 0 when the budget ran out or
+ * tasks were posted meanwhile
+ */
+static int io_loop_busy_poll(io_loop_t* loop, int timeout)
 {
-#define IO_MAX_EVENTS 60
+    uint64_t budget = loop->busy_poll * 1000;
+    uint64_t start = stopwatch_measure();
+    int n;
+
+    if (timeout > 0 && budget > (uint64_t)timeout * 1000000)
+    {
+        budget = (uint64_t)timeout * 1000000;
+    }
+
+    do
+    {
+        n = epoll_wait(loop->epoll, loop->events, loop->events_size, 0);
+        if (n != 0 || !mpscq_empty(&loop->tasks))
+        {
+            return n;
+        }
+    }
+    while (stopwatch_nanoseconds(start, stopwatch_measure()) < budget);
 
-    struct epoll_event events[IO_MAX_EVENTS];
-    task_t* task;
+    return 0;
+}
+
+// Full batches ask for a bigger one next time
+static void io_loop_events_grow(io_loop_t* loop)
+{
+    struct epoll_event* events;
+    int size = loop->events_size * 2;
+
+    if (size > loop->events_max)
+    {
+        size = loop->events_max;
+    }
+
+    if (size <= loop->events_size)
+    {
+        return;
+    }
+
+    events = (struct epoll_event*)io_realloc(loop->events, size * sizeof(struct epoll_event));
+    if (events != 0)
+    {
+        loop->events = events;
+        loop->events_size = size;
+    }
+}
+
+int io_loop_run(io_loop_t* loop)
+{
+    struct epoll_event* events;
     io_handle_t* handle;
     eventfd_t value;
-    uint64_t now;
-    uint64_t nearest_event_time;
+    uint64_t start;
     int timeout;
-    int error;
     int n, i;
 
-    // Prepare
-    memset(events, 0, sizeof(struct epoll_event) * IO_MAX_EVENTS);
-
     set_thread_loop(loop);
+    io_watchdog_register(loop);
+
+    if (loop->cpu >= 0)
+    {
+        io_loop_bind(loop);
+    }
 
     // Execute entry if provided
     if (loop->entry)
@@ -132,32 +227,78 @@ int io_loop_run(io_loop_t* loop)
         io_loop_post(loop, loop->entry, loop->arg);
     }
 
-    now = time_current();
-    loop->last_activity_time = now;
+    io_loop_update_time(loop);
+    loop->last_activity_time = loop->now;
 
     // Event loop
     do
     {
-        if (0 < moments_tick(&loop->sleeps, now))
+        if (0 < moments_tick(&loop->sleeps, loop->now))
+        {
+            loop->last_activity_time = loop->now;
+        }
+
+#if IO_USE_URING
+        io_uring_process(loop);
+#endif
+
+        if (io_loop_has_local(loop))
         {
-            now = time_current();
-            loop->last_activity_time = now;
+            io_loop_process_tasks(loop);
         }
 
-        nearest_event_time = io_loop_nearest_event_time(loop);
-        if (nearest_event_time == 0)
-            timeout = -1;
-        else
-            timeout = (int)nearest_event_time;
+        // Do not block with own posts pending
+        timeout = io_loop_has_local(loop) ? 0 : io_loop_wait_timeout(loop, loop->now);
+
+#if IO_USE_URING
+        // Entries prepared by the tasks above, nothing else would submit them
+        if (io_uring_flush(loop) != 0)
+        {
+            timeout = 0;
+        }
+#endif
 
         if (atomic_load64(&loop->shutdown))
         {
             break;
         }
 
-        n = epoll_wait(loop->epoll, events, IO_MAX_EVENTS, timeout);
+        io_loop_beat(loop);
+
+        n = 0;
 
-        now = time_current();
+        if (timeout != 0 && loop->busy_poll > 0)
+        {
+            n = io_loop_busy_poll(loop, timeout);
+        }
+
+        if (n == 0)
+        {
+            // Cross-thread posts write the wakeup only while the loop sleeps
+            if (timeout != 0 && !io_loop_sleep_begin(loop))
+            {
+                timeout = 0;
+            }
+
+            start = timeout != 0 ? PERFORMANCE_MEASURE() : 0;
+
+            n = epoll_wait(loop->epoll, loop->events, loop->events_size, timeout);
+
+            io_loop_sleep_end(loop);
+
+            if (timeout != 0)
+            {
+                counter_increment(&loop->performance.loop_idle,
+                                  PERFORMANCE_NANOSECONDS(start, PERFORMANCE_MEASURE()));
+            }
+        }
+
+        // The only clock read per iteration
+        io_loop_update_time(loop);
+
+        io_loop_beat(loop);
+
+        counter_increment(&loop->performance.loop_iteration, 0);
 
         if (n == -1)
         {
@@ -170,47 +311,81 @@ int io_loop_run(io_loop_t* loop)
 
         if (n > 0)
         {
+            events = loop->events;
+
             for (i = 0; i < n; ++i)
             {
                 if (events[i].data.ptr == &loop->wakeup)
                 {
-                    // reset state
-                    if (0 != eventfd_read(loop->wakeup.fd, &value))
-                    {
-                        error = errno;
-                    }
+                    // reset state, nothing to do when already reset
+                    eventfd_read(loop->wakeup.fd, &value);
                 }
                 else
                 {
                     handle = (io_handle_t*)events[i].data.ptr;
                     handle->processor(handle, events[i].events);   
                 }
-
-                now = time_current();
-                loop->last_activity_time = now;
             }
 
             io_loop_process_tasks(loop);
 
-            now = time_current();
-            loop->last_activity_time = now;
+            loop->last_activity_time = loop->now;
+
+            if (n == loop->events_size)
+            {
+                io_loop_events_grow(loop);
+            }
         }
         else // wait timeout
         {
-            if (0 < moments_tick(&loop->idles, now))
+            // Posted while the loop was about to sleep
+            io_loop_process_tasks(loop);
+
+            if (0 < moments_tick(&loop->idles, loop->now))
             {
-                now = time_current();
-                loop->last_activity_time = now;
+                loop->last_activity_time = loop->now;
             }
         }
 
-        moments_tick(&loop->timeouts, now);
+        moments_tick(&loop->timeouts, loop->now);
+
+        task_cache_trim(&loop->task_cache, loop->now);
+        io_pool_trim(&loop->buffers, loop->now);
     }
     while (1);
 
+    io_watchdog_unregister(loop);
+
     // Unref
     io_loop_unref(loop);
 
     set_thread_loop(0);
     return 0;
+}
+
+/*
+ * Public API
+ */
+
+int io_loop_set_max_events(io_loop_t* loop, size_t max_events)
+{
+    if (max_events == 0 || max_events > INT_MAX)
+    {
+        return EINVAL;
+    }
+
+    loop->events_max = (int)max_events;
+
+    if (loop->events_size > loop->events_max)
+    {
+        loop->events_size = loop->events_max;
+    }
+
+    return 0;
+}
+
+int io_loop_set_busy_poll(io_loop_t* loop, uint64_t microseconds)
+{
+    loop->busy_poll = microseconds;
+    return 0;
 }
\ No newline at end of file
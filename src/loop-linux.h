@@ -32,6 +32,9 @@ extern "C" {
 #define IO_READ    1
 #define IO_WRITE   2
 
+// Streams are registered once, see io_stream_attach
+#define IO_STREAM_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
 static int io_loop_update(io_loop_t* loop, int fd, struct epoll_event* e, int events)
 {
     int error = 0;
@@ -83,6 +86,15 @@ static int io_loop_write_del(io_loop_t* loop, int fd, struct epoll_event* e)
         return io_loop_update(loop, fd, e, 0);
 }
 
+static int io_loop_uring(io_loop_t* loop)
+{
+#if IO_USE_URING
+    return loop->uring.fd != -1;
+#else
+    return 0;
+#endif
+}
+
 static int io_close(int fd)
 {
     while (0 != close(fd))
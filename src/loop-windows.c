@@ -23,6 +23,8 @@
 #include "time.h"
 #include "moment.h"
 #include "atomic.h"
+#include "task.h"
+#include "watchdog.h"
 
 DECLARE_THREAD_LOCAL(io_loop_t*, loop, 0);
 
@@ -41,6 +43,8 @@ int io_loop_init(io_loop_t* loop)
 	memset(loop, 0, sizeof(*loop));
 
 	// Init task scheduler
+	loop->cpu = -1;
+	loop->stats_time = time_monotonic();
 	loop->current = &loop->main;
 	loop->main.loop = loop;
 	loop->prev = 0;
@@ -54,6 +58,8 @@ int io_loop_init(io_loop_t* loop)
 	}
 
 	mpscq_init(&loop->tasks);
+	task_cache_init(&loop->task_cache);
+	io_pool_init(&loop->buffers, IO_LOOP_BUFFER_SIZE, IO_LOOP_BUFFER_LIMIT);
 	// mpscq_init(&loop->waiters);
 
 	return 0;
@@ -61,6 +67,9 @@ int io_loop_init(io_loop_t* loop)
 
 int io_loop_cleanup(io_loop_t* loop)
 {
+	task_cache_cleanup(&loop->task_cache);
+	io_pool_cleanup(&loop->buffers);
+
 	// ToDo: implement
 	return 0;
 }
@@ -91,11 +100,16 @@ int io_loop_run(io_loop_t* loop)
 	BOOL failed;
 	io_handle_t* handle;
 	uint64_t timeout;
-	uint64_t now;
-	uint64_t nearest_event_time;
+	uint64_t start;
 	int error;
 
 	set_thread_loop(loop);
+	io_watchdog_register(loop);
+
+	if (loop->cpu >= 0)
+	{
+		io_loop_bind(loop);
+	}
 
 	// Execute entry if provided
 	if (loop->entry)
@@ -103,22 +117,23 @@ int io_loop_run(io_loop_t* loop)
 		io_loop_post(loop, loop->entry, loop->arg);
 	}
 
-	now = time_current();
-	loop->last_activity_time = now;
+	io_loop_update_time(loop);
+	loop->last_activity_time = loop->now;
 
 	do
 	{
-		if (0 < moments_tick(&loop->sleeps, now))
+		if (0 < moments_tick(&loop->sleeps, loop->now))
 		{
-			now = time_current();
-			loop->last_activity_time = now;
+			loop->last_activity_time = loop->now;
+		}
+
+		if (io_loop_has_local(loop))
+		{
+			io_loop_process_tasks(loop);
 		}
 
-		nearest_event_time = io_loop_nearest_event_time(loop);
-		if (nearest_event_time == 0)
-			timeout = -1;
-		else
-			timeout = (int)nearest_event_time;
+		// Do not block with own posts pending
+		timeout = io_loop_has_local(loop) ? 0 : io_loop_wait_timeout(loop, loop->now);
 
 		if (atomic_load64(&loop->shutdown))
 		{
@@ -128,10 +143,32 @@ int io_loop_run(io_loop_t* loop)
 		failed = 0;
 		sys_error = 0;
 
+		io_loop_beat(loop);
+
+		// Cross-thread posts wake the loop only while it sleeps
+		if (timeout != 0 && !io_loop_sleep_begin(loop))
+		{
+			timeout = 0;
+		}
+
+		start = timeout != 0 ? PERFORMANCE_MEASURE() : 0;
+
 		status = GetQueuedCompletionStatus(loop->iocp, &transfered, &key,
 			&overlapped, (DWORD)timeout);
 
-		now = time_current();
+		io_loop_sleep_end(loop);
+
+		if (timeout != 0)
+		{
+			counter_increment(&loop->performance.loop_idle,
+				PERFORMANCE_NANOSECONDS(start, PERFORMANCE_MEASURE()));
+		}
+
+		io_loop_update_time(loop);
+
+		io_loop_beat(loop);
+
+		counter_increment(&loop->performance.loop_iteration, 0);
 
 		if (status == FALSE)
 		{
@@ -164,10 +201,9 @@ int io_loop_run(io_loop_t* loop)
 					failed = 0;
 					key = 0;
 
-					if (0 < moments_tick(&loop->idles, now))
+					if (0 < moments_tick(&loop->idles, loop->now))
 					{
-						now = time_current();
-						loop->last_activity_time = now;
+						loop->last_activity_time = loop->now;
 					}
 				}
 			}
@@ -194,20 +230,14 @@ int io_loop_run(io_loop_t* loop)
 			
 			io_loop_process_tasks(loop);
 
-			now = time_current();
-			loop->last_activity_time = now;
+			loop->last_activity_time = loop->now;
 		}
 
-		moments_tick(&loop->timeouts, now);
-
-		now = time_current();
+		moments_tick(&loop->timeouts, loop->now);
 
 	} while (!failed);
 
-	if (0 != io_loop_cleanup(loop))
-	{
-		/* handle error */
-	}
+	io_watchdog_unregister(loop);
 
 	error = 0;
 
@@ -224,5 +254,23 @@ int io_loop_run(io_loop_t* loop)
 	//	}
 	//}
 
+	// Unref, cleaned up with the last reference like on linux
+	io_loop_unref(loop);
+
 	return error;
+}
+
+/*
+ * Public API
+ */
+
+int io_loop_set_max_events(io_loop_t* loop, size_t max_events)
+{
+	// GetQueuedCompletionStatus dequeues one completion at a time
+	return ENOTSUP;
+}
+
+int io_loop_set_busy_poll(io_loop_t* loop, uint64_t microseconds)
+{
+	return ENOTSUP;
 }
\ No newline at end of file
@@ -48,6 +48,18 @@ static void io_loop_exec_entry(io_loop_t* loop, void* arg)
 }
 
 
+// Stolen tasks run per call before own events are polled again
+#define IO_LOOP_STEAL_LIMIT 16
+
+// One in this many own thread posts measures its scheduling latency
+#define IO_LOOP_SCHEDULE_SAMPLE 8
+
+struct io_loop_group_t {
+    atomic64_t refs; // running loops and the owner
+    size_t count;
+    io_loop_t** loops;
+};
+
 task_t* io_loop_fetch_next_task(io_loop_t* loop)
 {
     mpscq_node_t* node;
@@ -59,31 +71,248 @@ task_t* io_loop_fetch_next_task(io_loop_t* loop)
     return task;
 }
 
-void io_loop_process_tasks(io_loop_t* loop)
+static void io_loop_post_run(io_loop_t* loop, task_t* task)
 {
-    task_t* task;
     int error;
 
-    task = io_loop_fetch_next_task(loop);
-    while (task != 0)
+    counter_increment(&loop->performance.loop_post, 0);
+
+#if IO_PERFORMANCE
+    if (task->post_time != 0)
+    {
+        histogram_record(&loop->latency.schedule,
+                         PERFORMANCE_NANOSECONDS(task->post_time, PERFORMANCE_MEASURE()));
+        task->post_time = 0;
+    }
+#endif
+
+    error = task_post(task, loop);
+    if (error)
     {
-        if (task->loop == loop)
+        /* no stack for the task, drop it */
+        task_delete(task);
+    }
+}
+
+static task_t* io_loop_group_steal(io_loop_t* loop)
+{
+    io_loop_group_t* group = loop->group;
+    io_loop_t* victim;
+    task_t* task;
+    size_t i;
+
+    for (i = 1; i < group->count; ++i)
+    {
+        victim = group->loops[(loop->group_index + i) % group->count];
+
+        task = (task_t*)deque_steal(&victim->runnable);
+        if (task != 0)
         {
-            // Wakeup
-            task_resume(task);
+            loop->steals++;
+            atomic_incr64(&victim->stolen);
+            return task;
         }
-        else
+    }
+
+    return 0;
+}
+
+// Wakes up to surplus sleeping siblings to steal what this loop cannot run now
+static void io_loop_group_notify(io_loop_t* loop, int64_t surplus)
+{
+    io_loop_group_t* group = loop->group;
+    io_loop_t* sibling;
+    size_t i;
+
+    for (i = 1; i < group->count && surplus > 0; ++i)
+    {
+        sibling = group->loops[(loop->group_index + i) % group->count];
+
+        if (atomic_cas64(&sibling->sleeping, 1, 0))
         {
-            // Post
-            error = task_post(task, loop);
-            if (error)
-            {
-                /* handle error */
-            }
-        }        
-        
+            io_loop_wakeup(sibling);
+            surplus--;
+        }
+    }
+}
+
+// Returns 1 when the task was queued for the group
+static int io_loop_dispatch(io_loop_t* loop, task_t* task)
+{
+    if (task->loop == loop)
+    {
+        // Wakeup
+        task_resume(task);
+    }
+    else if (loop->group != 0 && task->is_stealable &&
+             deque_push(&loop->runnable, task))
+    {
+        // Not started yet, any loop of the group may run it
+        return 1;
+    }
+    else
+    {
+        // Post
+        io_loop_post_run(loop, task);
+    }
+
+    return 0;
+}
+
+void io_loop_process_tasks(io_loop_t* loop)
+{
+    task_t* task;
+    task_t* next;
+    int64_t queued;
+    int stolen = 0;
+
+    do
+    {
+        queued = 0;
+
+        // Tasks posted meanwhile wait for the next iteration
+        task = loop->local.head;
+        loop->local.head = 0;
+        loop->local.tail = 0;
+
+        while (task != 0)
+        {
+            next = container_of(task->node.next, task_t, node);
+            queued += io_loop_dispatch(loop, task);
+            task = next;
+        }
+
         task = io_loop_fetch_next_task(loop);
+        while (task != 0)
+        {
+            queued += io_loop_dispatch(loop, task);
+            task = io_loop_fetch_next_task(loop);
+        }
+
+        if (loop->group == 0)
+        {
+            return;
+        }
+
+        if (queued > 1)
+        {
+            io_loop_group_notify(loop, deque_size(&loop->runnable) - 1);
+        }
+
+        while ((task = (task_t*)deque_pop(&loop->runnable)) != 0)
+        {
+            io_loop_post_run(loop, task);
+        }
+
+        if (stolen == IO_LOOP_STEAL_LIMIT)
+        {
+            // Own events first, io_loop_sleep_begin brings the loop back
+            return;
+        }
+
+        task = io_loop_group_steal(loop);
+        if (task == 0)
+        {
+            return;
+        }
+
+        stolen++;
+        io_loop_post_run(loop, task);
+    }
+    while (1);
+}
+
+/*
+ * Called before blocking for events. Producers write the wakeup only while
+ * the loop is sleeping, see io_loop_signal. Returns 0 when there are tasks
+ * already and the loop should not block
+ */
+int io_loop_sleep_begin(io_loop_t* loop)
+{
+    io_loop_group_t* group = loop->group;
+    size_t i;
+
+    // Full barrier, pairs with io_loop_signal
+    atomic_cas64(&loop->sleeping, 0, 1);
+
+    if (!mpscq_empty(&loop->tasks))
+    {
+        atomic_store64(&loop->sleeping, 0);
+        return 0;
+    }
+
+    for (i = 1; group != 0 && i < group->count; ++i)
+    {
+        if (deque_size(&group->loops[(loop->group_index + i) % group->count]->runnable) > 0)
+        {
+            atomic_store64(&loop->sleeping, 0);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void io_loop_sleep_end(io_loop_t* loop)
+{
+    atomic_store64(&loop->sleeping, 0);
+}
+
+/*
+ * Pins the calling loop thread to loop->cpu. Cached stacks are released so
+ * new ones are first touched, and so allocated, on the local NUMA node
+ */
+int io_loop_bind(io_loop_t* loop)
+{
+    int error = io_thread_set_affinity(loop->cpu);
+    if (!error)
+    {
+        task_cache_cleanup(&loop->task_cache);
     }
+
+    return error;
+}
+
+static void io_loop_bind_entry(io_loop_t* loop, void* arg)
+{
+    io_loop_bind(loop);
+}
+
+static void io_loop_group_release(io_loop_group_t* group)
+{
+    task_t* task;
+    size_t i;
+
+    if (atomic_decr64(&group->refs) != 0)
+    {
+        return;
+    }
+
+    // All loops have stopped
+    for (i = 0; i < group->count; ++i)
+    {
+        while ((task = (task_t*)deque_pop(&group->loops[i]->runnable)) != 0)
+        {
+            task_delete(task);
+        }
+
+        group->loops[i]->group = 0;
+        io_loop_unref(group->loops[i]);
+    }
+
+    io_free(group->loops);
+    io_free(group);
+}
+
+static IO_THREAD_TYPE io_loop_group_entry(void* arg)
+{
+    io_loop_t* loop = (io_loop_t*)arg;
+    io_loop_group_t* group = loop->group;
+
+    io_loop_run(loop);
+    io_loop_group_release(group);
+
+    return 0;
 }
 
 IO_THREAD_TYPE io_thread_entry(void* arg)
@@ -167,35 +396,408 @@ int io_loop_unref(io_loop_t* loop)
     return 0;
 }
 
+/*
+ * Clock reading for the scheduling latency of a post, 0 skips it. Posts from
+ * a loop's own thread are sampled as the two clock reads would cost about as
+ * much as the post itself
+ */
+static uint64_t io_loop_post_time(io_loop_t* current)
+{
+#if IO_PERFORMANCE
+    if (current != 0 && current->latency.posts++ % IO_LOOP_SCHEDULE_SAMPLE != 0)
+    {
+        return 0;
+    }
+
+    return PERFORMANCE_MEASURE();
+#else
+    return 0;
+#endif
+}
+
 int io_loop_post(io_loop_t* loop, io_loop_fn entry, void* arg)
+{
+    return io_loop_post_ex(loop, entry, arg, 0);
+}
+
+int io_loop_post_ex(
+    io_loop_t* loop,
+    io_loop_fn entry,
+    void* arg,
+    const io_loop_post_options_t* options)
 {
     task_t* task;
 
     io_loop_t* current = io_loop_current();
-    int error = task_create(&task, entry, arg);
+    int error = task_create(&task, loop, entry, arg, options ? options->stack_size : 0);
 
     if (error)
     {
         return error;
     }
 
-    // always async post 
-    //if (current == loop)
-    //{
-    //    error = task_post(task, current);
-    //}
-    //else
+    task->is_stealable = options ? options->stealable : 0;
+    task->post_time = io_loop_post_time(current);
+
+    // Always async, runs on next loop iteration
+    io_loop_post_task(loop, task);
+
+    return 0;
+}
+
+int io_loop_post_batch(io_loop_t* loop, const io_loop_job_t* jobs, size_t count)
+{
+    task_t* first = 0;
+    task_t* last = 0;
+    task_t* task;
+    size_t i;
+    int error;
+    uint64_t now = io_loop_post_time(io_loop_current());
+
+    for (i = 0; i < count; ++i)
     {
-        mpscq_push(&loop->tasks, &task->node);
-        error = io_loop_wakeup(loop);
+        error = task_create(&task, loop, jobs[i].entry, jobs[i].arg, 0);
+        if (error)
+        {
+            // All or nothing
+            while (first != 0)
+            {
+                task = first;
+                first = (task == last) ? 0 : container_of(task->node.next, task_t, node);
+                task_delete(task);
+            }
+
+            return error;
+        }
+
+        task->post_time = now;
+
+        if (last != 0)
+            last->node.next = &task->node;
+        else
+            first = task;
+
+        last = task;
+    }
+
+    if (first == 0)
+    {
+        return 0;
+    }
+
+    // One exchange and at most one wakeup for the whole batch
+    io_loop_post_chain(loop, first, last);
+
+    return 0;
+}
+
+int io_loop_set_affinity(io_loop_t* loop, int cpu)
+{
+    if (cpu < 0)
+    {
+        return EINVAL;
+    }
+
+    loop->cpu = cpu;
+
+    if (loop == io_loop_current())
+    {
+        return io_loop_bind(loop);
+    }
+
+    // Applied on the loop's own thread
+    return io_loop_post(loop, io_loop_bind_entry, 0);
+}
+
+int io_loop_set_task_cache(io_loop_t* loop, size_t limit, uint64_t trim_milliseconds)
+{
+    // Applied on next trim
+    loop->task_cache.limit = limit;
+    loop->task_cache.trim_interval = trim_milliseconds;
+    loop->task_cache.trim_time = 0;
+
+    return 0;
+}
+
+static void io_loop_stack_size_entry(io_loop_t* loop, void* arg)
+{
+    task_cache_set_stack_size(&loop->task_cache, (size_t)(uintptr_t)arg);
+}
+
+int io_loop_set_stack_size(io_loop_t* loop, size_t size)
+{
+    if (size == 0)
+    {
+        return EINVAL;
+    }
+
+    if (loop == io_loop_current())
+    {
+        return task_cache_set_stack_size(&loop->task_cache, size);
+    }
+
+    // Applied on the loop's own thread, the cache belongs to it
+    return io_loop_post(loop, io_loop_stack_size_entry, (void*)(uintptr_t)size);
+}
+
+int io_loop_stack_usage(io_loop_t* loop, size_t* high_water)
+{
+#if defined(NDEBUG) || PLATFORM_WINDOWS
+    *high_water = 0;
+    return ENOTSUP;
+#else
+    *high_water = loop->stack_high_water;
+    return 0;
+#endif
+}
+
+int io_loop_group_start(io_loop_group_t** group, size_t count)
+{
+    io_loop_group_t* created;
+    io_loop_t* loop;
+    size_t started;
+    size_t i;
+    int pin = 0;
+    int error = 0;
+
+    *group = 0;
+
+    // One loop per processor, each pinned to its own
+    if (count == 0)
+    {
+        count = (size_t)io_thread_cpu_count();
+        pin = 1;
+    }
+
+    created = (io_loop_group_t*)io_calloc(1, sizeof(*created));
+    if (created == 0)
+    {
+        return ENOMEM;
+    }
+
+    created->loops = (io_loop_t**)io_calloc(count, sizeof(io_loop_t*));
+    if (created->loops == 0)
+    {
+        io_free(created);
+        return ENOMEM;
+    }
+
+    for (i = 0; i < count && !error; ++i)
+    {
+        loop = (io_loop_t*)io_malloc(sizeof(io_loop_t));
+        if (loop == 0)
+        {
+            error = ENOMEM;
+            break;
+        }
+
+        error = io_loop_init(loop);
+        if (error)
+        {
+            io_free(loop);
+            break;
+        }
+
+        loop->group = created;
+        loop->group_index = i;
+
+        if (pin)
+        {
+            loop->cpu = io_thread_cpu_at((int)i);
+        }
+        deque_init(&loop->runnable);
+
+        // One for the group, one released when the loop stops
+        io_loop_ref(loop);
+        io_loop_ref(loop);
+
+        created->loops[i] = loop;
     }
 
     if (error)
     {
-        task_delete(task);
+        while (i-- > 0)
+        {
+            io_loop_cleanup(created->loops[i]);
+            io_free(created->loops[i]);
+        }
+
+        io_free(created->loops);
+        io_free(created);
+        return error;
     }
 
-    return error;
+    created->count = count;
+    atomic_store64(&created->refs, 1);
+
+    for (started = 0; started < count; ++started)
+    {
+        atomic_incr64(&created->refs);
+
+        error = io_thread_create(io_loop_group_entry, created->loops[started]);
+        if (error)
+        {
+            atomic_decr64(&created->refs);
+            break;
+        }
+    }
+
+    if (error)
+    {
+        // Loops never run do not drop their own reference
+        for (i = started; i < count; ++i)
+        {
+            io_loop_unref(created->loops[i]);
+        }
+
+        io_loop_group_stop(created);
+        return error;
+    }
+
+    *group = created;
+    return 0;
+}
+
+int io_loop_group_stop(io_loop_group_t* group)
+{
+    size_t i;
+
+    for (i = 0; i < group->count; ++i)
+    {
+        io_loop_stop(group->loops[i]);
+    }
+
+    io_loop_group_release(group);
+
+    return 0;
+}
+
+size_t io_loop_group_size(io_loop_group_t* group)
+{
+    return group->count;
+}
+
+io_loop_t* io_loop_group_get(io_loop_group_t* group, size_t index)
+{
+    if (index >= group->count)
+    {
+        return 0;
+    }
+
+    return group->loops[index];
+}
+
+int io_loop_steal_stats(io_loop_t* loop, uint64_t* steals, uint64_t* stolen)
+{
+    *steals = loop->steals;
+    *stolen = atomic_load64(&loop->stolen);
+
+    return 0;
+}
+
+static void io_stats_counter(io_counter_t* counter, const counter_t* current,
+                             const counter_t* last, uint64_t period)
+{
+    counter->count = current->count;
+    counter->nanoseconds = current->nanoseconds;
+    counter->rate = period > 0 ? (current->count - last->count) * 1000.0 / period : 0;
+}
+
+int io_stats_get(io_loop_t* loop, io_stats_t* stats)
+{
+#if IO_PERFORMANCE
+    performance_t current;
+    uint64_t now = time_monotonic();
+
+    // Counters and the previous snapshot are plain, only the owner reads them whole
+    if (loop != io_loop_current())
+    {
+        memset(stats, 0, sizeof(*stats));
+        return EINVAL;
+    }
+
+    memcpy(&current, &loop->performance, sizeof(current));
+
+    stats->period = now - loop->stats_time;
+
+    io_stats_counter(&stats->loop_iteration, &current.loop_iteration, &loop->stats_last.loop_iteration, stats->period);
+    io_stats_counter(&stats->loop_idle, &current.loop_idle, &loop->stats_last.loop_idle, stats->period);
+    io_stats_counter(&stats->loop_post, &current.loop_post, &loop->stats_last.loop_post, stats->period);
+    io_stats_counter(&stats->task_swapcontext, &current.task_swapcontext, &loop->stats_last.task_swapcontext, stats->period);
+    io_stats_counter(&stats->memory_alloc, &current.memory_alloc, &loop->stats_last.memory_alloc, stats->period);
+    io_stats_counter(&stats->memory_free, &current.memory_free, &loop->stats_last.memory_free, stats->period);
+    io_stats_counter(&stats->file_open, &current.file_open, &loop->stats_last.file_open, stats->period);
+    io_stats_counter(&stats->file_create, &current.file_create, &loop->stats_last.file_create, stats->period);
+    io_stats_counter(&stats->file_read, &current.file_read, &loop->stats_last.file_read, stats->period);
+    io_stats_counter(&stats->file_write, &current.file_write, &loop->stats_last.file_write, stats->period);
+    io_stats_counter(&stats->tcp_connect, &current.tcp_connect, &loop->stats_last.tcp_connect, stats->period);
+    io_stats_counter(&stats->tcp_accept, &current.tcp_accept, &loop->stats_last.tcp_accept, stats->period);
+    io_stats_counter(&stats->tcp_accept_retry, &current.tcp_accept_retry, &loop->stats_last.tcp_accept_retry, stats->period);
+    io_stats_counter(&stats->tcp_read, &current.tcp_read, &loop->stats_last.tcp_read, stats->period);
+    io_stats_counter(&stats->tcp_write, &current.tcp_write, &loop->stats_last.tcp_write, stats->period);
+    io_stats_counter(&stats->threadpool_post, &current.threadpool_post, &loop->stats_last.threadpool_post, stats->period);
+    io_stats_counter(&stats->event_wait, &current.event_wait, &loop->stats_last.event_wait, stats->period);
+    io_stats_counter(&stats->event_notify, &current.event_notify, &loop->stats_last.event_notify, stats->period);
+
+    memcpy(&loop->stats_last, &current, sizeof(current));
+    loop->stats_time = now;
+
+    return 0;
+#else
+    memset(stats, 0, sizeof(*stats));
+    return ENOTSUP;
+#endif
+}
+
+int io_loop_latency(io_loop_t* loop, io_latency_type_t type,
+                    double percentile, uint64_t* nanoseconds)
+{
+    *nanoseconds = 0;
+
+#if IO_PERFORMANCE
+    switch (type)
+    {
+#if IO_STREAM_LATENCY
+    case IO_LATENCY_READ:
+        *nanoseconds = histogram_percentile(&loop->latency.read, percentile);
+        return 0;
+    case IO_LATENCY_WRITE:
+        *nanoseconds = histogram_percentile(&loop->latency.write, percentile);
+        return 0;
+#else
+    case IO_LATENCY_READ:
+    case IO_LATENCY_WRITE:
+        // Not measured with IO_STREAM_TIMING=0
+        return ENOTSUP;
+#endif
+    case IO_LATENCY_ACCEPT:
+        *nanoseconds = histogram_percentile(&loop->latency.accept, percentile);
+        return 0;
+    case IO_LATENCY_SCHEDULE:
+        *nanoseconds = histogram_percentile(&loop->latency.schedule, percentile);
+        return 0;
+    default:
+        return EINVAL;
+    }
+#else
+    return ENOTSUP;
+#endif
+}
+
+int io_loop_latency_reset(io_loop_t* loop)
+{
+#if IO_PERFORMANCE
+#if IO_STREAM_LATENCY
+    histogram_reset(&loop->latency.read);
+    histogram_reset(&loop->latency.write);
+#endif
+    histogram_reset(&loop->latency.accept);
+    histogram_reset(&loop->latency.schedule);
+
+    return 0;
+#else
+    return ENOTSUP;
+#endif
 }
 
 int io_loop_exec(io_loop_t* loop, io_loop_fn entry, void* arg)
@@ -229,15 +831,14 @@ int io_loop_exec(io_loop_t* loop, io_loop_fn entry, void* arg)
 int io_loop_sleep(uint64_t milliseconds)
 {
     moment_t moment;
-    uint64_t now = time_current();
     io_loop_t* current = io_loop_current();
 
     memset(&moment, 0, sizeof (moment));
 
     moment.task = current->current;
-    moment.time = now + milliseconds;
+    moment.time = current->now + milliseconds;
 
-    moments_add(&current->sleeps, &moment);
+    moments_add(&current->sleeps, &moment, current->now);
     task_suspend(current->current);
 
     if (moment.removed)
@@ -257,15 +858,14 @@ int io_loop_sleep(uint64_t milliseconds)
 int io_loop_idle(io_loop_t* loop, uint64_t milliseconds)
 {
     moment_t moment;
-    uint64_t now = time_current();
     io_loop_t* current = io_loop_current();
 
     memset(&moment, 0, sizeof (moment));
 
     moment.task = current->current;
-    moment.time = now + milliseconds;
+    moment.time = current->now + milliseconds;
 
-    moments_add(&current->idles, &moment);
+    moments_add(&current->idles, &moment, current->now);
     task_suspend(current->current);
 
     if (moment.removed)
@@ -26,11 +26,17 @@
 extern "C" {
 #endif
 
+#include <limits.h>
 #include "io.h"
 #include "mpscq.h"
+#include "deque.h"
+#include "performance.h"
+#include "histogram.h"
+#include "pool.h"
 #include "moment.h"
 #include "platform.h"
 #include "atomic.h"
+#include "time.h"
 
 #if PLATFORM_WINDOWS
 #   define  WIN32_LEAN_AND_MEAN 1
@@ -39,8 +45,16 @@ extern "C" {
 #   include <sys/epoll.h>
 #endif
 
+#if PLATFORM_LINUX && IO_USE_URING
+#   include "uring-linux.h"
+#endif
+
 #include "task/context.h"
+#if USE_FASTCONTEXT
+typedef fastcontext_t context_t;
+#else
 typedef ucontext_t context_t;
+#endif
 
 typedef struct task_t {
     mpscq_node_t node;
@@ -53,12 +67,32 @@ typedef struct task_t {
     void*       arg;
     int         is_done;
     int         is_post;
+    int         is_trimmed;
+    int         is_stealable; // another loop of a group may run it
     int         inherit_error_state;
+    uint64_t    post_time;  // stopwatch reading at post, 0 when not measured
 } task_t;
 
+#define IO_TASK_CACHE_LIMIT 64
+#define IO_TASK_CACHE_TRIM_INTERVAL 1000 // milliseconds
+
+#define IO_LOOP_BUFFER_SIZE (16 * 1024)
+#define IO_LOOP_BUFFER_LIMIT 64
+
+typedef struct task_cache_t {
+    task_t*     head;           // most recently released first
+    size_t      count;
+    size_t      limit;
+    size_t      low;            // lowest count since last trim
+    uint64_t    trim_interval;  // milliseconds, 0 disables trimming
+    uint64_t    trim_time;
+    size_t      stack_size;     // default of the loop's tasks, only these are cached
+} task_cache_t;
+
 typedef struct io_loop_t {
     atomic64_t refs;
     atomic64_t shutdown;
+    uint64_t now; // monotonic milliseconds, cached once per iteration
     uint64_t last_activity_time;
 
     // Task scheduler
@@ -76,17 +110,63 @@ typedef struct io_loop_t {
     io_loop_fn entry;
     void* arg;
 
-    mpscq_t tasks;
+    mpscq_t tasks;          // posts from other threads
+    struct {
+        task_t* head;
+        task_t* tail;
+    } local;                // posts from the loop's own thread
+    atomic64_t sleeping;    // blocked for events, see io_loop_signal
+    task_cache_t task_cache;
+    io_pool_t buffers;      // write buffers of corked streams
+    size_t stack_high_water; // debug builds only
+
+    int cpu;                // pinned processor or -1, see io_loop_set_affinity
+
+    // Work stealing, see io_loop_group_start
+    struct io_loop_group_t* group;
+    size_t group_index;
+    uint64_t steals;        // tasks taken from siblings
+    atomic64_t stolen;      // tasks taken by siblings
+    deque_t runnable;       // posted tasks not started yet
+
+    // Watchdog, see io_watchdog_start
+    atomic64_t beat;        // iterations twice, odd while waiting for events
+    uint64_t beat_reported; // watchdog thread only, last stall reported
+    struct io_loop_t* watched_next;
+
+    // Counters, see io_stats_get
+    performance_t performance;
+    performance_t stats_last;
+    uint64_t stats_time;
+#if IO_PERFORMANCE
+    struct {
+#if IO_STREAM_LATENCY
+        histogram_t read;
+        histogram_t write;
+#endif
+        histogram_t accept;
+        histogram_t schedule;
+        uint64_t posts;     // own thread posts, see io_loop_post_time
+    } latency;              // see io_loop_latency
+#endif
 
     // Platform specific
 #if PLATFORM_WINDOWS
     HANDLE iocp;
 #elif PLATFORM_LINUX
     int epoll;
+    struct epoll_event* events;
+    int events_size;        // grows up to events_max while batches come back full
+    int events_max;
+    uint64_t busy_poll;     // microseconds to poll before blocking, 0 disables
+    int splice[2];          // spare pipe of io_stream_pipe, -1 when none
     struct {
         int fd;
         struct epoll_event event;
     } wakeup;
+#   if IO_USE_URING
+    io_uring_t uring;
+#   endif
 #else
 #   error Not implemented
 #endif
@@ -100,18 +180,67 @@ static uint64_t io_loop_nearest_event_time(io_loop_t* loop)
     uint64_t nearest_idle = moments_nearest(&loop->idles);
     uint64_t nearest_timeout = moments_nearest(&loop->timeouts);
 
-    if (0 < nearest_sleep && nearest_sleep < nearest_time)
+    if (0 < nearest_sleep && (nearest_time == 0 || nearest_sleep < nearest_time))
         nearest_time = nearest_sleep;
 
-    if (0 < nearest_idle && nearest_idle < nearest_time)
+    if (0 < nearest_idle && (nearest_time == 0 || nearest_idle < nearest_time))
         nearest_time = nearest_idle;
 
-    if (0 < nearest_timeout && nearest_timeout < nearest_time)
+    if (0 < nearest_timeout && (nearest_time == 0 || nearest_timeout < nearest_time))
         nearest_time = nearest_timeout;
 
     return nearest_time;
 }
 
+static void io_loop_update_time(io_loop_t* loop)
+{
+    loop->now = time_monotonic();
+}
+
+/*
+ * Milliseconds to wait for events until nearest moment, -1 when
+ * there is none
+ */
+static int io_loop_wait_timeout(io_loop_t* loop, uint64_t now)
+{
+    uint64_t nearest_time = io_loop_nearest_event_time(loop);
+
+    if (nearest_time == 0)
+        return -1;
+
+    if (nearest_time <= now)
+        return 0;
+
+    if (nearest_time - now > INT_MAX)
+        return INT_MAX;
+
+    return (int)(nearest_time - now);
+}
+
+/*
+ * Allocations for tasks and streams of a loop, counted there by callers
+ * which hold the loop rather than looked up per call. loop may be 0
+ */
+static FORCEINLINE void* io_loop_calloc(io_loop_t* loop, size_t count, size_t size)
+{
+    if (loop != 0)
+    {
+        counter_increment(&loop->performance.memory_alloc, 0);
+    }
+
+    return io_calloc(count, size);
+}
+
+static FORCEINLINE void io_loop_free(io_loop_t* loop, void* ptr)
+{
+    if (loop != 0 && ptr != 0)
+    {
+        counter_increment(&loop->performance.memory_free, 0);
+    }
+
+    io_free(ptr);
+}
+
 /*
  * Internal API
  */
@@ -123,11 +252,69 @@ int io_loop_run(io_loop_t* loop);
 io_loop_t* io_loop_current();
 
 void io_loop_process_tasks(io_loop_t* loop);
+int io_loop_bind(io_loop_t* loop);
+int io_loop_sleep_begin(io_loop_t* loop);
+void io_loop_sleep_end(io_loop_t* loop);
+
+/*
+ * Wakes the loop only when it is blocked for events and no wakeup is
+ * pending, an awake loop checks its queue before sleeping again. A failed
+ * wakeup leaves the loop marked sleeping, so the next post tries again
+ */
+static void io_loop_signal(io_loop_t* loop)
+{
+    if (!atomic_cas64(&loop->sleeping, 1, 0))
+    {
+        return;
+    }
+
+    if (io_loop_wakeup(loop) != 0)
+    {
+        atomic_cas64(&loop->sleeping, 0, 1);
+    }
+}
+
+/*
+ * Marks waiting for events begin and end for the watchdog, the cached time
+ * is updated before the end so it tells when the loop got busy
+ */
+static FORCEINLINE void io_loop_beat(io_loop_t* loop)
+{
+    atomic_store64(&loop->beat, loop->beat.nonatomic + 1);
+}
+
+static int io_loop_has_local(io_loop_t* loop)
+{
+    return loop->local.head != 0;
+}
+
+/*
+ * Posts tasks linked from first to last. Posts from the loop's own thread go
+ * to a plain list run before the loop blocks again, other threads need the
+ * mpscq and a wakeup. Published tasks belong to the loop, posting cannot fail
+ */
+static void io_loop_post_chain(io_loop_t* loop, task_t* first, task_t* last)
+{
+    last->node.next = 0;
+
+    if (loop == io_loop_current())
+    {
+        if (loop->local.tail != 0)
+            loop->local.tail->node.next = &first->node;
+        else
+            loop->local.head = first;
+
+        loop->local.tail = last;
+        return;
+    }
+
+    mpscq_push_chain(&loop->tasks, &first->node, &last->node);
+    io_loop_signal(loop);
+}
 
-static int io_loop_post_task(io_loop_t* loop, task_t* task)
+static void io_loop_post_task(io_loop_t* loop, task_t* task)
 {
-    mpscq_push(&loop->tasks, &task->node);
-    return io_loop_wakeup(loop);
+    io_loop_post_chain(loop, task, task);
 }
 
 #ifdef __cplusplus
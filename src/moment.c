@@ -22,6 +22,8 @@
 #include "moment.h"
 #include "task.h"
 
+#if IO_MOMENTS_RBTREE
+
 static int moment_compare(rbnode_t* node1, rbnode_t* node2)
 {
     uint64_t time1 = ((moment_t*)node1)->time;
@@ -48,15 +50,22 @@ static void moment_init(moment_t* moment)
     moment->shutdown = 0;
 }
 
-void moments_add(moments_t* moments, moment_t* moment)
+void moments_add(moments_t* moments, moment_t* moment, uint64_t now)
 {
+    (void)now;
+
     moment_init(moment);
     rbtree_insert(&moments->root, &moment->node, moment_compare);
 }
 
 void moments_remove(moments_t* moments, moment_t* moment)
 {
-    rbtree_remove(&moments->root, &moment->node, moment_compare);
+    // Reached and shutdown moments are already out of the tree
+    if (!moment->reached && !moment->shutdown && !moment->removed)
+    {
+        rbtree_remove(&moments->root, &moment->node, moment_compare);
+    }
+
     moment->removed = 1;
 }
 
@@ -127,4 +136,337 @@ uint64_t moments_nearest(moments_t* moments)
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+#else
+
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#endif
+
+#define MOMENTS_SHIFT(level) \
+    ((level) == 0 ? 0 : MOMENTS_LEVEL0_BITS + ((level) - 1) * MOMENTS_LEVELN_BITS)
+
+#define MOMENTS_OFFSET(level) \
+    ((level) == 0 ? 0 : (1 << MOMENTS_LEVEL0_BITS) + ((level) - 1) * (1 << MOMENTS_LEVELN_BITS))
+
+#define MOMENTS_MASK(level) \
+    ((level) == 0 ? (1 << MOMENTS_LEVEL0_BITS) - 1 : (1 << MOMENTS_LEVELN_BITS) - 1)
+
+#define MOMENTS_BLOCK(level) \
+    (((uint64_t)1 << MOMENTS_SHIFT(level)) - 1)
+
+#define MOMENTS_LEVEL0_WORDS ((1 << MOMENTS_LEVEL0_BITS) / 64)
+
+static unsigned moments_ctz(uint64_t bits)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctzll(bits);
+#endif
+}
+
+/*
+ * A moment stays in the lowest level whose slots cover the current block
+ * of base, so each slot holds moments of exactly one period
+ */
+static void moments_link(moments_t* moments, moment_t* moment)
+{
+    uint64_t time = moment->time < moments->base ? moments->base : moment->time;
+    moment_t** head;
+    unsigned level;
+    unsigned slot;
+
+    for (level = 0; level < MOMENTS_LEVELS; ++level)
+    {
+        if ((time >> MOMENTS_SHIFT(level + 1)) ==
+            (moments->base >> MOMENTS_SHIFT(level + 1)))
+        {
+            break;
+        }
+    }
+
+    if (level < MOMENTS_LEVELS)
+    {
+        slot = MOMENTS_OFFSET(level) +
+            (unsigned)((time >> MOMENTS_SHIFT(level)) & MOMENTS_MASK(level));
+
+        moments->occupied[slot / 64] |= (uint64_t)1 << (slot % 64);
+        head = &moments->slots[slot];
+    }
+    else
+    {
+        slot = MOMENTS_SLOTS;
+        head = &moments->overflow;
+    }
+
+    moment->slot = slot;
+    moment->next = *head;
+    moment->pprev = head;
+
+    if (*head)
+    {
+        (*head)->pprev = &moment->next;
+    }
+
+    *head = moment;
+}
+
+static void moments_unlink(moments_t* moments, moment_t* moment)
+{
+    *moment->pprev = moment->next;
+
+    if (moment->next)
+    {
+        moment->next->pprev = moment->pprev;
+    }
+
+    if (moment->slot < MOMENTS_SLOTS && moments->slots[moment->slot] == 0)
+    {
+        moments->occupied[moment->slot / 64] &= ~((uint64_t)1 << (moment->slot % 64));
+    }
+
+    moment->next = 0;
+    moment->pprev = 0;
+}
+
+static moment_t* moments_detach(moments_t* moments, unsigned slot)
+{
+    moment_t* list;
+    moment_t* moment;
+
+    if (slot < MOMENTS_SLOTS)
+    {
+        list = moments->slots[slot];
+        moments->slots[slot] = 0;
+        moments->occupied[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    }
+    else
+    {
+        list = moments->overflow;
+        moments->overflow = 0;
+    }
+
+    for (moment = list; moment; moment = moment->next)
+    {
+        moment->pprev = 0;
+    }
+
+    return list;
+}
+
+static void moments_relink(moments_t* moments, unsigned slot)
+{
+    moment_t* temp;
+    moment_t* moment = moments_detach(moments, slot);
+
+    while (moment)
+    {
+        temp = moment->next;
+        moments_link(moments, moment);
+        moment = temp;
+    }
+}
+
+/*
+ * Moves moments of the block starting at base down the levels,
+ * higher levels first so their moments land in already emptied slots
+ */
+static void moments_cascade(moments_t* moments)
+{
+    uint64_t base = moments->base;
+    int level;
+
+    if ((base & MOMENTS_BLOCK(MOMENTS_LEVELS)) == 0)
+    {
+        moments_relink(moments, MOMENTS_SLOTS);
+    }
+
+    for (level = MOMENTS_LEVELS - 1; level > 0; --level)
+    {
+        if ((base & MOMENTS_BLOCK(level)) == 0)
+        {
+            moments_relink(moments, MOMENTS_OFFSET(level) +
+                (unsigned)((base >> MOMENTS_SHIFT(level)) & MOMENTS_MASK(level)));
+        }
+    }
+}
+
+/*
+ * Earliest time something is due or has to be cascaded, exact for
+ * level 0 and start of the first occupied slot for others
+ */
+static uint64_t moments_next(moments_t* moments)
+{
+    uint64_t base = moments->base;
+    uint64_t bits;
+    int level;
+    int i;
+
+    for (i = 0; i < MOMENTS_LEVEL0_WORDS; ++i)
+    {
+        if (moments->occupied[i])
+        {
+            return (base & ~MOMENTS_BLOCK(1)) | (i * 64 + moments_ctz(moments->occupied[i]));
+        }
+    }
+
+    for (level = 1; level < MOMENTS_LEVELS; ++level)
+    {
+        bits = moments->occupied[MOMENTS_LEVEL0_WORDS + level - 1];
+        if (bits)
+        {
+            return (base & ~MOMENTS_BLOCK(level + 1)) |
+                ((uint64_t)moments_ctz(bits) << MOMENTS_SHIFT(level));
+        }
+    }
+
+    return (base | MOMENTS_BLOCK(MOMENTS_LEVELS)) + 1;
+}
+
+void moments_add(moments_t* moments, moment_t* moment, uint64_t now)
+{
+    if (moments->count == 0 && moments->base < now)
+    {
+        // Wheel was idle, catch up to the caller's clock without walking elapsed slots
+        moments->base = now;
+    }
+
+    moment->reached = 0;
+    moment->removed = 0;
+    moment->shutdown = 0;
+
+    moments_link(moments, moment);
+    moments->count++;
+}
+
+void moments_remove(moments_t* moments, moment_t* moment)
+{
+    // Reached and shutdown moments are already unlinked
+    if (moment->pprev)
+    {
+        moments_unlink(moments, moment);
+        moments->count--;
+    }
+
+    moment->removed = 1;
+}
+
+void moments_shutdown(moments_t* moments)
+{
+    moment_t* dues = 0;
+    moment_t* temp;
+    moment_t* moment;
+    unsigned slot;
+
+    for (slot = 0; slot <= MOMENTS_SLOTS; ++slot)
+    {
+        moment = moments_detach(moments, slot);
+        while (moment)
+        {
+            temp = moment->next;
+            moment->next = dues;
+            dues = moment;
+            moment = temp;
+        }
+    }
+
+    moments->count = 0;
+
+    moment = dues;
+    while (moment)
+    {
+        temp = moment->next;
+        moment->next = 0;
+
+        moment->shutdown = 1;
+        task_resume(moment->task);
+
+        moment = temp;
+    }
+}
+
+uint64_t moments_tick(moments_t* moments, uint64_t now)
+{
+    uint64_t count = 0;
+    uint64_t next;
+    unsigned slot;
+    moment_t* dues = 0;
+    moment_t** tail = &dues;
+    moment_t* temp;
+    moment_t* moment;
+
+    while (moments->count > 0 && moments->base <= now)
+    {
+        next = moments_next(moments);
+        if (next > now)
+        {
+            // Nothing due up to now
+            moments->base = now + 1;
+            if ((moments->base & MOMENTS_BLOCK(1)) == 0)
+            {
+                moments_cascade(moments);
+            }
+            break;
+        }
+
+        moments->base = next;
+        slot = (unsigned)(next & MOMENTS_MASK(0));
+
+        if (moments->occupied[slot / 64] & ((uint64_t)1 << (slot % 64)))
+        {
+            *tail = moments_detach(moments, slot);
+            while (*tail)
+            {
+                (*tail)->reached = 1;
+                moments->count--;
+                tail = &(*tail)->next;
+            }
+
+            moments->base = next + 1;
+            if ((moments->base & MOMENTS_BLOCK(1)) == 0)
+            {
+                moments_cascade(moments);
+            }
+        }
+        else
+        {
+            moments_cascade(moments);
+        }
+    }
+
+    if (moments->count == 0 && moments->base <= now)
+    {
+        moments->base = now + 1;
+    }
+
+    // Resume dues
+    moment = dues;
+    while (moment)
+    {
+        temp = moment->next;
+        moment->next = 0;
+
+        task_resume(moment->task);
+        ++count;
+
+        moment = temp;
+    }
+
+    return count;
+}
+
+uint64_t moments_nearest(moments_t* moments)
+{
+    if (moments->count == 0)
+    {
+        return 0;
+    }
+
+    return moments_next(moments);
+}
+
+#endif // IO_MOMENTS_RBTREE
\ No newline at end of file
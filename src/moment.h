@@ -23,14 +23,24 @@
 #define IO_MOMENT_H_INCLUDED
 
 #include <stdint.h> // uint64_t
-#include "rbtree.h"
+#include <stddef.h> // size_t
+
+#if IO_MOMENTS_RBTREE
+#   include "rbtree.h"
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct moment_t {
+#if IO_MOMENTS_RBTREE
     struct rbnode_t node;
+#else
+    struct moment_t* next;
+    struct moment_t** pprev;    // 0 when not in wheel
+    unsigned slot;
+#endif
     struct task_t* task;
     uint64_t time;
     unsigned reached : 1;
@@ -38,11 +48,37 @@ typedef struct moment_t {
     unsigned shutdown : 1;
 } moment_t;
 
+#if IO_MOMENTS_RBTREE
+
 typedef struct moments_t {
     struct rbnode_t* root;
 } moments_t;
 
-void moments_add(moments_t* moments, moment_t* moment);
+#else
+
+/*
+ * Hierarchical timing wheel with millisecond resolution:
+ * level 0 has 256 slots of 1ms, levels 1-3 have 64 slots of 256ms,
+ * ~16s and ~17min, moments beyond ~18h wait in overflow list
+ */
+
+#define MOMENTS_LEVEL0_BITS 8
+#define MOMENTS_LEVELN_BITS 6
+#define MOMENTS_LEVELS      4
+#define MOMENTS_SLOTS       ((1 << MOMENTS_LEVEL0_BITS) + \
+                             (MOMENTS_LEVELS - 1) * (1 << MOMENTS_LEVELN_BITS))
+
+typedef struct moments_t {
+    uint64_t base;      // next millisecond to expire
+    size_t count;
+    uint64_t occupied[MOMENTS_SLOTS / 64];
+    struct moment_t* slots[MOMENTS_SLOTS];
+    struct moment_t* overflow;
+} moments_t;
+
+#endif
+
+void moments_add(moments_t* moments, moment_t* moment, uint64_t now);
 void moments_remove(moments_t* moments, moment_t* moment);
 void moments_shutdown(moments_t* moments);
 uint64_t moments_tick(moments_t* moments, uint64_t now);
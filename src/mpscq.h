@@ -53,17 +53,29 @@ static void mpscq_init(mpscq_t* queue)
     queue->stub.next = 0;
 }
 
-static void mpscq_push(mpscq_t* queue, mpscq_node_t* node)
+// Publishes nodes linked from first to last with a single exchange
+static void mpscq_push_chain(mpscq_t* queue, mpscq_node_t* first, mpscq_node_t* last)
 {
     mpscq_node_t* prev;
 
-    node->next = 0;
+    last->next = 0;
 #if PLATFORM_WINDOWS
-    prev = InterlockedExchangePointerAcquire(&queue->head, node);
+    prev = InterlockedExchangePointerAcquire(&queue->head, last);
 #else
-    prev = __sync_lock_test_and_set(&queue->head, node);
+    prev = __sync_lock_test_and_set(&queue->head, last);
 #endif
-    prev->next = node;
+    prev->next = first;
+}
+
+static void mpscq_push(mpscq_t* queue, mpscq_node_t* node)
+{
+    mpscq_push_chain(queue, node, node);
+}
+
+// Consumer only, a push still in progress counts as not empty
+static int mpscq_empty(mpscq_t* queue)
+{
+    return queue->tail == &queue->stub && queue->head == &queue->stub;
 }
 
 static mpscq_node_t* mpscq_pop(mpscq_t* queue)
@@ -23,42 +23,74 @@
 #define IO_PERFORMANCE_H_INCLUDED
 
 #include <stdint.h> // uint64_t
-#include "atomic.h"
+#include "platform.h"
+#include "stopwatch.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * Per loop counters, written by the loop thread only so increments are
+ * plain, readers get a snapshot which may lag. Compiled out with
+ * IO_PERFORMANCE=0
+ */
+
+#ifndef IO_PERFORMANCE
+#   define IO_PERFORMANCE 1
+#endif
+
+#if IO_PERFORMANCE
+#   define PERFORMANCE_MEASURE() stopwatch_measure()
+#   define PERFORMANCE_NANOSECONDS(start, end) stopwatch_nanoseconds(start, end)
+#else
+#   define PERFORMANCE_MEASURE() 0
+#   define PERFORMANCE_NANOSECONDS(start, end) ((void)(start), (void)(end), (uint64_t)0)
+#endif
+
+// Read and write histograms take their samples from stream timing
+#if IO_PERFORMANCE && IO_STREAM_TIMING
+#   define IO_STREAM_LATENCY 1
+#else
+#   define IO_STREAM_LATENCY 0
+#endif
+
+#define PERFORMANCE_CACHE_LINE 64
+
 typedef struct counter_t {
-    atomic64_t count;
-    atomic64_t nanoseconds;
+    uint64_t count;
+    uint64_t nanoseconds;
 } counter_t;
 
 typedef struct performance_t {
+    char pad0[PERFORMANCE_CACHE_LINE]; // away from fields other threads write
+    counter_t loop_iteration;
+    counter_t loop_idle;
+    counter_t loop_post;
+    counter_t task_swapcontext;
     counter_t memory_alloc;
     counter_t memory_free;
-    counter_t task_swapcontext;
-    counter_t loop_post;
-    counter_t loop_idle;
     counter_t file_open;
     counter_t file_create;
     counter_t file_read;
     counter_t file_write;
+    counter_t tcp_connect;
+    counter_t tcp_accept;
+    counter_t tcp_accept_retry;
     counter_t tcp_read;
     counter_t tcp_write;
-	counter_t tcp_connect;
-    counter_t time_current;
     counter_t threadpool_post;
-    counter_t event_watch;
+    counter_t event_wait;
     counter_t event_notify;
+    char pad1[PERFORMANCE_CACHE_LINE];
 } performance_t;
 
-static performance_t performance = {0};
-
-static void counter_increment(counter_t* counter, uint64_t nanoseconds)
+static FORCEINLINE void counter_increment(counter_t* counter, uint64_t nanoseconds)
 {
-    atomic_incr64(&counter->count);
-    atomic_add64(&counter->nanoseconds, nanoseconds);
+#if IO_PERFORMANCE
+    counter->count++;
+    counter->nanoseconds += nanoseconds;
+#endif
 }
 
 #ifdef __cplusplus
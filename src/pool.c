@@ -21,3 +21,115 @@
 
 #include "memory.h"
 #include "pool.h"
+
+#define IO_POOL_TRIM_INTERVAL 1000 // milliseconds
+
+typedef struct io_pool_block_t {
+    struct io_pool_block_t* next;
+} io_pool_block_t;
+
+static void* io_pool_pop(io_pool_t* pool)
+{
+    io_pool_block_t* block = (io_pool_block_t*)pool->free_list;
+
+    if (block == 0)
+    {
+        return 0;
+    }
+
+    pool->free_list = block->next;
+    pool->count--;
+
+    if (pool->count < pool->low)
+    {
+        pool->low = pool->count;
+    }
+
+    return block;
+}
+
+/*
+ * Internal API
+ */
+
+void io_pool_init(io_pool_t* pool, size_t block_size, size_t limit)
+{
+    pool->free_list = 0;
+    pool->block_size = block_size < sizeof(io_pool_block_t) ? sizeof(io_pool_block_t) : block_size;
+    pool->count = 0;
+    pool->limit = limit;
+    pool->used = 0;
+    pool->low = 0;
+    pool->trim_interval = IO_POOL_TRIM_INTERVAL;
+    pool->trim_time = 0;
+}
+
+void io_pool_cleanup(io_pool_t* pool)
+{
+    void* block = io_pool_pop(pool);
+
+    while (block != 0)
+    {
+        io_free(block);
+        block = io_pool_pop(pool);
+    }
+}
+
+void io_pool_trim(io_pool_t* pool, uint64_t now)
+{
+    size_t idle;
+
+    if (pool->trim_interval == 0 || now < pool->trim_time)
+    {
+        return;
+    }
+
+    /*
+     * blocks not taken during the whole interval are released
+     */
+
+    idle = pool->low < pool->count ? pool->low : pool->count;
+    while (idle > 0)
+    {
+        io_free(io_pool_pop(pool));
+        idle--;
+    }
+
+    pool->low = pool->count;
+    pool->trim_time = now + pool->trim_interval;
+}
+
+void* io_pool_alloc(io_pool_t* pool)
+{
+    void* block = io_pool_pop(pool);
+
+    if (block == 0)
+    {
+        block = io_malloc(pool->block_size);
+        if (block == 0)
+        {
+            return 0;
+        }
+    }
+
+    pool->used++;
+
+    return block;
+}
+
+void io_pool_free(io_pool_t* pool, void* block)
+{
+    io_pool_block_t* node = (io_pool_block_t*)block;
+
+    pool->used--;
+
+    if (pool->count >= pool->limit)
+    {
+        io_free(block);
+        return;
+    }
+
+    node->next = (io_pool_block_t*)pool->free_list;
+    pool->free_list = node;
+    pool->count++;
+}
\ No newline at end of file
@@ -29,21 +29,25 @@
 extern "C" {
 #endif
 
+/*
+ * Fixed size blocks kept on a free list, owned by a single loop
+ */
 typedef struct io_pool_t {
-    uint64_t last_usage;
-    uint64_t last_time;
-    uint64_t interval;
-    uint64_t current_usage;
-    uint64_t used;
-    uint64_t free;
-    uint64_t block_size;
-    void* free_list;
+    void*       free_list;      // most recently released first
+    size_t      block_size;
+    size_t      count;          // blocks on the free list
+    size_t      limit;
+    size_t      used;           // blocks handed out
+    size_t      low;            // lowest count since last trim
+    uint64_t    trim_interval;  // milliseconds, 0 disables trimming
+    uint64_t    trim_time;
 } io_pool_t;
 
-void  io_pool_init(io_pool_t* pool);
+void  io_pool_init(io_pool_t* pool, size_t block_size, size_t limit);
 void  io_pool_cleanup(io_pool_t* pool);
-void* io_pool_alloc(io_pool_t* pool, size_t size);
-void  io_pool_free(io_pool_t* pool, void* prt);
+void  io_pool_trim(io_pool_t* pool, uint64_t now);
+void* io_pool_alloc(io_pool_t* pool);
+void  io_pool_free(io_pool_t* pool, void* block);
 
 #ifdef __cplusplus
 } // extern "C"
@@ -31,6 +31,24 @@ extern "C" {
 uint64_t stopwatch_measure();
 uint64_t stopwatch_nanoseconds(uint64_t start, uint64_t end);
 
+/*
+ * Per operation stream timing (info read/write period), two clock
+ * reads per operation, compiled out with IO_STREAM_TIMING=0
+ */
+
+#ifndef IO_STREAM_TIMING
+#   define IO_STREAM_TIMING 1
+#endif
+
+#if IO_STREAM_TIMING
+#   define STOPWATCH_MEASURE() stopwatch_measure()
+#   define STOPWATCH_NANOSECONDS(start, end) stopwatch_nanoseconds(start, end)
+#else
+    // Readings still count as used, so their locals need no guard
+#   define STOPWATCH_MEASURE() 0
+#   define STOPWATCH_NANOSECONDS(start, end) ((void)(start), (void)(end), (uint64_t)0)
+#endif
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
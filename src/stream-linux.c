@@ -20,6 +20,10 @@
  */
 
 #include <aio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include "memory.h"
 #include "stream.h"
 #include "time.h"
@@ -27,21 +31,14 @@
 #include "stopwatch.h"
 #include "task.h"
 #include "fs.h"
+#include "threadpool.h"
 #include "loop-linux.h"
 
-typedef struct io_tcp_read_req_t {
-    char* buffer;
-    uint64_t length;
-    uint64_t done;
-    task_t* task;   
-} io_tcp_read_req_t;
+// Vectors per readv/writev call
+#define IO_STREAM_IOV 64
 
-typedef struct io_tcp_write_req_t {
-    const char* buffer;
-    uint64_t length;
-    uint64_t offset;
-    task_t* task;
-} io_tcp_write_req_t;
+// Smallest size moved per call by the zero-copy pipe
+#define IO_STREAM_PIPE_CHUNK (1024 * 1024)
 
 typedef struct io_file_read_req_t {
     struct aiocb aio;
@@ -59,58 +56,350 @@ typedef struct io_file_write_req_t {
     int error;
 } io_file_write_req_t;
 
-void io_stream_read_try(io_stream_t* stream)
+typedef struct io_file_copy_req_t {
+    int from;
+    int to;
+    loff_t from_offset;
+    loff_t to_offset;
+    size_t chunk_size;
+    uint64_t done;
+    int error;
+} io_file_copy_req_t;
+
+typedef struct io_file_writev_req_t {
+    int fd;
+    struct iovec* iov;
+    int iovcnt;
+    off_t offset;
+    uint64_t done;
+    int error;
+} io_file_writev_req_t;
+
+static int io_socket_error(int fd)
 {
-    io_tcp_read_req_t* data = (io_tcp_read_req_t*)stream->platform.read_req;
-    ssize_t n;
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length))
+    {
+        return errno;
+    }
+
+    return error ? error : EIO;
+}
+
+/*
+ * Suspends current task until readiness edge for stream is reported.
+ * Timeout moment is armed lazily on first wait and covers whole operation.
+ */
+static void io_stream_wait(io_stream_t* stream, int events, moment_t* timeout,
+                           uint64_t milliseconds)
+{
+    task_t* task = stream->loop->current;
+
+    if (milliseconds > 0 && timeout->time == 0)
+    {
+        timeout->time = stream->loop->now + milliseconds;
+        timeout->task = task;
+
+        moments_add(&stream->loop->timeouts, timeout, stream->loop->now);
+    }
+
+    if (events == IO_READ)
+        stream->platform.read_req = task;
+    else
+        stream->platform.write_req = task;
+
+    task_suspend(task);
+
+    if (events == IO_READ)
+        stream->platform.read_req = 0;
+    else
+        stream->platform.write_req = 0;
+}
+
+static void io_stream_wait_done(io_stream_t* stream, moment_t* timeout)
+{
+    if (timeout->time > 0 && !timeout->reached)
+    {
+        moments_remove(&stream->loop->timeouts, timeout);
+    }
+}
+
+static int io_stream_failed(io_stream_t* stream)
+{
+    return stream->info.status.error ||
+           stream->info.status.closed ||
+           stream->info.status.peer_closed ||
+           stream->info.status.shutdown;
+}
+
+// Loop counters and latencies of reads and writes by stream type
+static void io_stream_count(io_stream_t* stream, int write, uint64_t nanoseconds)
+{
+    performance_t* performance = &stream->loop->performance;
+
+    io_stream_latency_record(stream, write, nanoseconds);
+
+    if (stream->info.type == IO_STREAM_TCP)
+    {
+        counter_increment(write ? &performance->tcp_write : &performance->tcp_read, nanoseconds);
+    }
+    else
+    {
+        counter_increment(write ? &performance->file_write : &performance->file_read, nanoseconds);
+    }
+}
 
-    n = read(stream->fd, data->buffer, data->length);
-    if (n == -1)
+#if IO_USE_URING
+
+static size_t io_stream_uring_read(io_stream_t* stream, char* buffer, size_t length)
+{
+    struct io_uring_sqe* sqe;
+    uint64_t start, end;
+    unsigned chunk = length < IO_URING_MAX_LENGTH ? (unsigned)length : IO_URING_MAX_LENGTH;
+    int timedout = 0;
+    int result = -EAGAIN;
+
+    start = STOPWATCH_MEASURE();
+
+    stream->info.read.count += 1;
+
+    if (stream->info.type == IO_STREAM_TCP)
     {
-        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        // Data already queued in the socket is taken without a round trip
+        result = (int)recv(stream->fd, buffer, chunk, MSG_DONTWAIT);
+        if (result < 0)
         {
-            stream->info.status.error = errno;
-            stream->filters.head->on_status(stream->filters.head);
+            result = -errno;
         }
     }
-    else if (n == 0)
+
+    if (result == -EAGAIN || result == -EWOULDBLOCK)
     {
-        stream->info.status.eof = 1;
-        stream->filters.head->on_status(stream->filters.head);
+        sqe = io_uring_sqe_get(stream->loop);
+        if (sqe != 0)
+        {
+            if (stream->info.type == IO_STREAM_TCP)
+            {
+                sqe->opcode = IORING_OP_RECV;
+            }
+            else
+            {
+                sqe->opcode = IORING_OP_READ;
+                sqe->off = stream->impl.file.read_offset;
+            }
+
+            sqe->fd = stream->fd;
+            sqe->addr = (uint64_t)(uintptr_t)buffer;
+            sqe->len = chunk;
+
+            result = io_uring_sqe_wait(stream->loop, sqe, stream->info.read.timeout, &timedout);
+        }
+    }
+    else
+    {
+        stream->info.read.fast += 1;
+    }
+
+    end = STOPWATCH_MEASURE();
+    stream->info.read.period += STOPWATCH_NANOSECONDS(start, end);
+    io_stream_count(stream, 0, STOPWATCH_NANOSECONDS(start, end));
+
+    if (result > 0)
+    {
+        // Data already consumed by the kernel is returned even if timed out
+        if (stream->info.type == IO_STREAM_FILE)
+        {
+            stream->impl.file.read_offset += result;
+        }
+
+        stream->info.read.bytes += result;
+        return result;
+    }
+
+    if (timedout)
+    {
+        stream->info.status.read_timeout = 1;
+    }
+    else if (result < 0)
+    {
+        stream->info.status.error = -result;
     }
     else
     {
-        data->done = n;
+        stream->info.status.eof = 1;
     }
+
+    stream->filters.head->on_status(stream->filters.head);
+    return 0;
 }
 
-void io_stream_write_try(io_stream_t* stream)
+static size_t io_stream_uring_write(io_stream_t* stream, const char* buffer, size_t length)
 {
-    io_tcp_write_req_t* data = (io_tcp_write_req_t*)stream->platform.write_req;
+    struct io_uring_sqe* sqe;
+    uint64_t start, end;
+    size_t done = 0;
     ssize_t n;
+    int timedout = 0;
+    int result = 0;
 
-    n = write(stream->fd, data->buffer + data->offset, data->length - data->offset);
-    if (n > 0)
+    start = STOPWATCH_MEASURE();
+
+    stream->info.write.count += 1;
+
+    if (stream->info.type == IO_STREAM_TCP)
     {
-        data->offset += n;
+        // Fill socket buffer inline, only the rest goes through the ring
+        while (done < length)
+        {
+            n = send(stream->fd, buffer + done, length - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0)
+            {
+                done += n;
+            }
+            else if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            else
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    result = -errno;
+                }
+
+                break;
+            }
+        }
+
+        if (done == length)
+        {
+            stream->info.write.fast += 1;
+        }
     }
-    else
+
+    while (done < length && result == 0)
     {
-        if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        sqe = io_uring_sqe_get(stream->loop);
+        if (sqe == 0)
         {
-            stream->info.status.error = errno;
-            stream->filters.head->on_status(stream->filters.head);
+            result = -EAGAIN;
+            break;
+        }
+
+        if (stream->info.type == IO_STREAM_TCP)
+        {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->msg_flags = MSG_NOSIGNAL;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->off = stream->impl.file.write_offset;
+        }
+
+        sqe->fd = stream->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(buffer + done);
+        sqe->len = (length - done) < IO_URING_MAX_LENGTH ?
+            (unsigned)(length - done) : IO_URING_MAX_LENGTH;
+
+        result = io_uring_sqe_wait(stream->loop, sqe, stream->info.write.timeout, &timedout);
+        if (result <= 0)
+        {
+            break;
+        }
+
+        if (stream->info.type == IO_STREAM_FILE)
+        {
+            stream->impl.file.write_offset += result;
+        }
+
+        done += result;
+        result = 0;
+
+        if (timedout || atomic_load64(&stream->loop->shutdown))
+        {
+            break;
         }
     }
+
+    end = STOPWATCH_MEASURE();
+
+    stream->info.write.bytes += done;
+    stream->info.write.period += STOPWATCH_NANOSECONDS(start, end);
+    io_stream_count(stream, 1, STOPWATCH_NANOSECONDS(start, end));
+
+    if (done < length)
+    {
+        if (timedout)
+            stream->info.status.write_timeout = 1;
+        else if (result < 0)
+            stream->info.status.error = -result;
+        else
+            stream->info.status.shutdown = 1;
+
+        stream->filters.head->on_status(stream->filters.head);
+    }
+
+    return done;
 }
 
-static size_t io_stream_tcp_on_read(io_filter_t* filter, char* buffer, size_t length)
+#endif // IO_USE_URING
+
+/*
+ * Vectors are handed to readv/writev in batches, empty ones are skipped.
+ * Returns the number of vectors taken
+ */
+static size_t io_stream_iov_fill(struct iovec* iov, int* iovcnt, const io_iovec_t* vectors,
+                                 size_t count, size_t* length)
+{
+    size_t i;
+
+    *iovcnt = 0;
+    *length = 0;
+
+    for (i = 0; i < count && *iovcnt < IO_STREAM_IOV; ++i)
+    {
+        if (vectors[i].length == 0)
+        {
+            continue;
+        }
+
+        iov[*iovcnt].iov_base = vectors[i].buffer;
+        iov[*iovcnt].iov_len = vectors[i].length;
+        *length += vectors[i].length;
+        (*iovcnt)++;
+    }
+
+    return i;
+}
+
+// Moves past n bytes done, returns the vectors left
+static int io_stream_iov_consume(struct iovec** iov, int iovcnt, size_t n)
+{
+    while (iovcnt > 0 && n >= (*iov)->iov_len)
+    {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        iovcnt--;
+    }
+
+    if (iovcnt > 0)
+    {
+        (*iov)->iov_base = (char*)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+
+    return iovcnt;
+}
+
+static size_t io_stream_tcp_read(io_stream_t* stream, struct iovec* iov, int iovcnt, size_t length)
 {
-    io_stream_t* stream = filter->stream;
-    io_tcp_read_req_t read;
     moment_t timeout;
     uint64_t start, end, elapsed;
-    uint64_t timeout_value = stream->info.read.timeout;
+    ssize_t n = 0;
+    int waited = 0;
 
     if (length == 0)
     {
@@ -134,64 +423,90 @@ static size_t io_stream_tcp_on_read(io_filter_t* filter, char* buffer, size_t le
         return 0;
     }
 
-    read.buffer = buffer;
-    read.length = length;
-    read.done = 0;
-    read.task = stream->loop->current;
-
-    stream->platform.read_req = &read;
-
-    if (stream->info.read.timeout > 0)
-    {
-        timeout.time = time_current() + stream->info.read.timeout;
-        timeout.task = stream->loop->current;
-
-        moments_add(&stream->loop->timeouts, &timeout);
-    }
-    else
+#if IO_USE_URING
+    if (io_loop_uring(stream->loop))
     {
-        timeout.time = 0;
+        // A read may return less than asked, the first vector will do
+        return io_stream_uring_read(stream, (char*)iov[0].iov_base, iov[0].iov_len);
     }
+#endif
 
-    start = stopwatch_measure();
+    timeout.time = 0;
+    timeout.reached = 0;
 
-    io_loop_read_add(stream->loop, stream->fd, &stream->platform.e);
-
-    task_suspend(read.task);
+    start = STOPWATCH_MEASURE();
 
-    io_loop_read_del(stream->loop, stream->fd, &stream->platform.e);
+    do
+    {
+        if (stream->platform.readable)
+        {
+            n = readv(stream->fd, iov, iovcnt);
+            if (n > 0)
+            {
+                break;
+            }
+
+            if (n == 0)
+            {
+                stream->info.status.eof = 1;
+                stream->filters.head->on_status(stream->filters.head);
+                break;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                stream->info.status.error = errno;
+                stream->filters.head->on_status(stream->filters.head);
+                break;
+            }
+
+            // Drained, next edge sets it back
+            stream->platform.readable = 0;
+        }
 
-    end = stopwatch_measure();
-    elapsed = stopwatch_nanoseconds(start, end);
+        io_stream_wait(stream, IO_READ, &timeout, stream->info.read.timeout);
+        waited = 1;
 
-    if (timeout.time > 0)
-    {
-        moments_remove(&stream->loop->timeouts, &timeout);
+        if (timeout.reached)
+        {
+            stream->info.status.read_timeout = 1;
+            stream->filters.head->on_status(stream->filters.head);
+            break;
+        }
     }
+    while (!io_stream_failed(stream));
 
-    stream->platform.read_req = 0;
-    stream->info.read.bytes += read.done;
-    stream->info.read.period += elapsed;
+    io_stream_wait_done(stream, &timeout);
 
-    if (timeout.time > 0 && timeout.reached)
-    {
-        stream->info.status.read_timeout = 1;
-        stream->filters.head->on_status(stream->filters.head);
+    end = STOPWATCH_MEASURE();
+    elapsed = STOPWATCH_NANOSECONDS(start, end);
 
-        return 0;
-    }
-    else
+    stream->info.read.period += elapsed;
+    stream->info.read.count += 1;
+    io_stream_count(stream, 0, elapsed);
+
+    if (n > 0)
     {
-        return read.done;
+        stream->info.read.fast += !waited;
+        stream->info.read.bytes += n;
+        return n;
     }
+
+    return 0;
 }
 
-static size_t io_stream_tcp_on_write(io_filter_t* filter, const char* buffer, size_t length)
+static size_t io_stream_tcp_write(io_stream_t* stream, struct iovec* iov, int iovcnt, size_t length)
 {
-    io_stream_t* stream = filter->stream;
-    io_tcp_write_req_t write;
     moment_t timeout;
     uint64_t start, end, elapsed;
+    size_t offset = 0;
+    ssize_t n;
+    int waited = 0;
 
     if (length == 0)
     {
@@ -214,100 +529,202 @@ static size_t io_stream_tcp_on_write(io_filter_t* filter, const char* buffer, si
         return 0;
     }
 
-    write.buffer = buffer;
-    write.length = length;
-    write.offset = 0;
-    write.task = stream->loop->current;
-
-    stream->platform.write_req = &write;
-
-    if (stream->info.write.timeout > 0)
+#if IO_USE_URING
+    if (io_loop_uring(stream->loop))
     {
-        timeout.time = time_current() + stream->info.write.timeout;
-        timeout.task = stream->loop->current;
+        for (; iovcnt > 0; iov++, iovcnt--)
+        {
+            n = io_stream_uring_write(stream, (const char*)iov->iov_base, iov->iov_len);
+            offset += n;
 
-        moments_add(&stream->loop->timeouts, &timeout);
-    }
-    else
-    {
-        timeout.time = 0;
+            if ((size_t)n < iov->iov_len)
+                break;
+        }
+
+        return offset;
     }
+#endif
 
-    start = stopwatch_measure();
+    timeout.time = 0;
+    timeout.reached = 0;
 
-    io_loop_write_add(stream->loop, stream->fd, &stream->platform.e);
+    start = STOPWATCH_MEASURE();
 
-    do
+    while (offset < length)
     {
-        task_suspend(write.task);
+        if (stream->platform.writable)
+        {
+            n = writev(stream->fd, iov, iovcnt);
+            if (n > 0)
+            {
+                offset += n;
+                iovcnt = io_stream_iov_consume(&iov, iovcnt, n);
+                continue;
+            }
+
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                stream->info.status.error = errno;
+                stream->filters.head->on_status(stream->filters.head);
+                break;
+            }
+
+            // Socket buffer is full, next edge sets it back
+            stream->platform.writable = 0;
+        }
 
-        if (stream->info.status.write_timeout ||
-            stream->info.status.error ||
-            stream->info.status.closed ||
-            stream->info.status.peer_closed ||
-            stream->info.status.shutdown)
+        io_stream_wait(stream, IO_WRITE, &timeout, stream->info.write.timeout);
+        waited = 1;
+
+        if (timeout.reached)
         {
+            stream->info.status.write_timeout = 1;
+            stream->filters.head->on_status(stream->filters.head);
             break;
         }
 
-        if (timeout.time > 0 && timeout.reached)
+        if (io_stream_failed(stream))
         {
             break;
         }
     }
-    while (write.offset < write.length);
-
-    io_loop_write_del(stream->loop, stream->fd, &stream->platform.e);
 
-    end = stopwatch_measure();
-    elapsed = stopwatch_nanoseconds(start, end);
+    io_stream_wait_done(stream, &timeout);
 
-    if (timeout.time > 0)
-    {
-        moments_remove(&stream->loop->timeouts, &timeout);
-    }
+    end = STOPWATCH_MEASURE();
+    elapsed = STOPWATCH_NANOSECONDS(start, end);
 
-    stream->platform.write_req = 0;
-    stream->info.write.bytes += write.offset;
+    stream->info.write.bytes += offset;
     stream->info.write.period += elapsed;
+    stream->info.write.count += 1;
+    io_stream_count(stream, 1, elapsed);
+    stream->info.write.fast += (!waited && offset == length);
 
-    if (timeout.time > 0 && timeout.reached)
-    {
-        stream->info.status.write_timeout = 1;
-        stream->filters.head->on_status(stream->filters.head);
-    }
+    return offset;
+}
+
+static size_t io_stream_tcp_on_read(io_filter_t* filter, char* buffer, size_t length)
+{
+    struct iovec iov;
+
+    iov.iov_base = buffer;
+    iov.iov_len = length;
 
-    return write.offset;
+    return io_stream_tcp_read(filter->stream, &iov, 1, length);
 }
 
-static void io_file_read_completion_handler(sigval_t sigval)
+static size_t io_stream_tcp_on_readv(io_filter_t* filter, const io_iovec_t* vectors, size_t count)
 {
-    io_file_read_req_t* read = (io_file_read_req_t*)sigval.sival_ptr;
-    ssize_t result;
-    
-    read->error = aio_error(&read->aio);
-    if (read->error == 0)
-    {
-        result = aio_return(&read->aio);
-        if (result < 0)
-        {
-            read->error = errno;
-            result = 0;
-        }
+    struct iovec iov[IO_STREAM_IOV];
+    size_t length;
+    int iovcnt;
 
-        read->done = result;
-    }
+    io_stream_iov_fill(iov, &iovcnt, vectors, count, &length);
 
-    io_loop_post_task(read->loop, read->task);
+    return io_stream_tcp_read(filter->stream, iov, iovcnt, length);
 }
 
-static void io_file_write_completion_handler(sigval_t sigval)
+static size_t io_stream_tcp_on_write(io_filter_t* filter, const char* buffer, size_t length)
 {
-    io_file_write_req_t* write = (io_file_write_req_t*)sigval.sival_ptr;
-    ssize_t result;
+    struct iovec iov;
 
-    write->error = aio_error(&write->aio);
-    if (write->error == 0)
+    iov.iov_base = (char*)buffer;
+    iov.iov_len = length;
+
+    return io_stream_tcp_write(filter->stream, &iov, 1, length);
+}
+
+static size_t io_stream_tcp_on_writev(io_filter_t* filter, const io_iovec_t* vectors, size_t count)
+{
+    struct iovec iov[IO_STREAM_IOV];
+    size_t done = 0;
+    size_t length;
+    size_t used;
+    size_t n;
+    int iovcnt;
+
+    while (count > 0)
+    {
+        used = io_stream_iov_fill(iov, &iovcnt, vectors, count, &length);
+        vectors += used;
+        count -= used;
+
+        n = io_stream_tcp_write(filter->stream, iov, iovcnt, length);
+        done += n;
+
+        if (n < length)
+        {
+            break;
+        }
+    }
+
+    return done;
+}
+
+/*
+ * Reads from page cache without blocking, fails with EAGAIN when data
+ * has to come from disk
+ */
+static ssize_t io_stream_file_read_cached(io_stream_t* stream, struct iovec* iov, int iovcnt)
+{
+#if defined(RWF_NOWAIT)
+    ssize_t n;
+
+    if (!stream->platform.nowait_unsupported)
+    {
+        do
+        {
+            n = preadv2(stream->fd, iov, iovcnt, stream->impl.file.read_offset, RWF_NOWAIT);
+        }
+        while (n == -1 && errno == EINTR);
+
+        if (n != -1 || errno != EOPNOTSUPP)
+        {
+            return n;
+        }
+
+        // Filesystem does not support it, do not try again
+        stream->platform.nowait_unsupported = 1;
+    }
+#endif
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static void io_file_read_completion_handler(sigval_t sigval)
+{
+    io_file_read_req_t* read = (io_file_read_req_t*)sigval.sival_ptr;
+    ssize_t result;
+    
+    read->error = aio_error(&read->aio);
+    if (read->error == 0)
+    {
+        result = aio_return(&read->aio);
+        if (result < 0)
+        {
+            read->error = errno;
+            result = 0;
+        }
+
+        read->done = result;
+    }
+
+    io_loop_post_task(read->loop, read->task);
+}
+
+static void io_file_write_completion_handler(sigval_t sigval)
+{
+    io_file_write_req_t* write = (io_file_write_req_t*)sigval.sival_ptr;
+    ssize_t result;
+
+    write->error = aio_error(&write->aio);
+    if (write->error == 0)
     {
         result = aio_return(&write->aio);
         if (result < 0)
@@ -322,288 +739,855 @@ static void io_file_write_completion_handler(sigval_t sigval)
     io_loop_post_task(write->loop, write->task);
 }
 
+/*
+ * Vectors are filled from page cache in one call, a miss reads
+ * the first vector only, like read returning less than asked
+ */
+static size_t io_stream_file_read(io_stream_t* stream, struct iovec* iov, int iovcnt, size_t length)
+{
+    char* buffer = (char*)iov[0].iov_base;
+    io_file_read_req_t read;
+    moment_t timeout;
+    uint64_t start, end, elapsed;
+    ssize_t n;
+    int result;
+
+    if (length == 0)
+    {
+        return length;
+    }
+
+    if (stream->info.status.read_timeout ||
+        stream->info.status.eof ||
+        stream->info.status.error ||
+        stream->info.status.closed ||
+        stream->info.status.peer_closed ||
+        stream->info.status.shutdown)
+    {
+        return 0;
+    }
+
+    n = io_stream_file_read_cached(stream, iov, iovcnt);
+    if (n != -1 || errno != EAGAIN)
+    {
+        stream->info.read.count += 1;
+        io_stream_count(stream, 0, 0);
+
+        if (n > 0)
+        {
+            stream->info.read.fast += 1;
+            stream->info.read.bytes += n;
+            stream->impl.file.read_offset += n;
+            return n;
+        }
+
+        if (n == 0)
+            stream->info.status.eof = 1;
+        else
+            stream->info.status.error = errno;
+
+        stream->filters.head->on_status(stream->filters.head);
+        return 0;
+    }
+
+    length = iov[0].iov_len;
+
+#if IO_USE_URING
+    if (io_loop_uring(stream->loop))
+    {
+        return io_stream_uring_read(stream, buffer, length);
+    }
+#endif
+
+    memset(&read, 0, sizeof(io_file_read_req_t));
+
+    read.aio.aio_fildes = stream->fd;
+    read.aio.aio_buf = buffer;
+    read.aio.aio_nbytes = length;
+    read.aio.aio_offset = stream->impl.file.read_offset;
+    read.aio.aio_sigevent.sigev_notify = SIGEV_THREAD;
+    read.aio.aio_sigevent.sigev_notify_function = io_file_read_completion_handler;
+    read.aio.aio_sigevent.sigev_notify_attributes = 0;
+    read.aio.aio_sigevent.sigev_value.sival_ptr = &read;
+    read.done = 0;
+    read.loop = stream->loop;
+    read.task = stream->loop->current;
+
+    result = aio_read(&read.aio);
+
+    if (result == -1)
+    {
+        stream->info.status.error = errno;
+        stream->filters.head->on_status(stream->filters.head);
+        return 0;
+    }
+
+    if (stream->info.read.timeout > 0)
+    {
+        timeout.time = stream->loop->now + stream->info.read.timeout;
+        timeout.task = stream->loop->current;
+
+        moments_add(&stream->loop->timeouts, &timeout, stream->loop->now);        
+    }
+    else
+    {
+        timeout.time = 0;
+    }
+
+    start = STOPWATCH_MEASURE();
+
+    task_suspend(read.task);
+
+    end = STOPWATCH_MEASURE();
+    elapsed = STOPWATCH_NANOSECONDS(start, end);
+
+    stream->info.read.bytes += read.done;
+    stream->info.read.period += elapsed;
+    stream->info.read.count += 1;
+    io_stream_count(stream, 0, elapsed);
+
+    if (timeout.time > 0)
+    {
+        moments_remove(&stream->loop->timeouts, &timeout);
+    }
+
+    if (timeout.time > 0 && timeout.reached)
+    {
+        stream->info.read.timeout = 1;
+        stream->filters.head->on_status(stream->filters.head);
+
+        result = aio_cancel(stream->fd, &read.aio);
+        /* handle error */
+
+        return 0;
+    }
+    else
+    {
+        stream->impl.file.read_offset += read.done;
+        if (read.done == 0)
+        {
+            stream->info.status.eof = 1;
+        }
+
+        if (read.error)
+        {
+            stream->info.status.error = read.error;
+        }
+
+        if (read.done == 0 || read.error)
+        {
+            stream->filters.head->on_status(stream->filters.head);
+        }
+
+        return read.done;
+    }
+}
+
 static size_t io_stream_file_on_read(io_filter_t* filter, char* buffer, size_t length)
+{
+    struct iovec iov;
+
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+
+    return io_stream_file_read(filter->stream, &iov, 1, length);
+}
+
+static size_t io_stream_file_on_readv(io_filter_t* filter, const io_iovec_t* vectors, size_t count)
+{
+    struct iovec iov[IO_STREAM_IOV];
+    size_t length;
+    int iovcnt;
+
+    io_stream_iov_fill(iov, &iovcnt, vectors, count, &length);
+
+    return io_stream_file_read(filter->stream, iov, iovcnt, length);
+}
+
+size_t io_stream_file_on_write(io_filter_t* filter, const char* buffer, size_t length)
 {
     io_stream_t* stream = filter->stream;
-    io_file_read_req_t read;
+    io_file_write_req_t write;
     moment_t timeout;
     uint64_t start, end, elapsed;
+    uint64_t done = 0;
     int result;
 
-    if (length == 0)
+#if IO_USE_URING
+    if (io_loop_uring(stream->loop))
+    {
+        return io_stream_uring_write(stream, buffer, length);
+    }
+#endif
+
+    if (stream->info.write.timeout > 0)
+    {
+        timeout.time = stream->loop->now + stream->info.write.timeout;
+        timeout.task = stream->loop->current;
+
+        moments_add(&stream->loop->timeouts, &timeout, stream->loop->now);
+    }
+    else
+    {
+        timeout.time = 0;
+    }
+
+    start = STOPWATCH_MEASURE();
+
+    do
+    {
+        memset(&write, 0, sizeof(io_file_write_req_t));
+
+        write.aio.aio_fildes = stream->fd;
+        write.aio.aio_buf = (char*)buffer + done;
+        write.aio.aio_nbytes = length - done;
+        write.aio.aio_offset = stream->impl.file.write_offset;
+        write.aio.aio_sigevent.sigev_notify = SIGEV_THREAD;
+        write.aio.aio_sigevent.sigev_notify_function = io_file_write_completion_handler;
+        write.aio.aio_sigevent.sigev_notify_attributes = 0;
+        write.aio.aio_sigevent.sigev_value.sival_ptr = &write;
+        write.done = 0;
+        write.loop = stream->loop;
+        write.task = stream->loop->current;
+
+        result = aio_write(&write.aio);
+
+        if (result == -1)
+        {
+            stream->info.status.error = errno;
+            stream->filters.head->on_status(stream->filters.head);
+            break;
+        }
+
+        task_suspend(write.task);
+
+        if (atomic_load64(&stream->loop->shutdown))
+        {
+            stream->info.status.shutdown = 1;
+            stream->filters.head->on_status(stream->filters.head);
+            break;
+        }
+
+        if (stream->info.status.write_timeout ||
+            stream->info.status.error ||
+            stream->info.status.closed ||
+            stream->info.status.peer_closed ||
+            stream->info.status.shutdown)
+        {
+            break;
+        }
+
+        if (timeout.time > 0 && timeout.reached)
+        {
+            break;
+        }
+
+        if (write.error != 0)
+        {
+            stream->info.status.error = write.error;
+            stream->filters.head->on_status(stream->filters.head);
+            break;
+        }
+
+        stream->impl.file.write_offset += write.done;
+        done += write.done;
+
+    }
+    while (done < length);
+
+    end = STOPWATCH_MEASURE();
+    elapsed = STOPWATCH_NANOSECONDS(start, end);
+
+    stream->info.write.bytes += done;
+    stream->info.write.period += elapsed;
+    stream->info.write.count += 1;
+    io_stream_count(stream, 1, elapsed);
+
+    if (timeout.time > 0)
+    {
+        moments_remove(&stream->loop->timeouts, &timeout);
+    }
+
+    if (timeout.time > 0 && timeout.reached)
+    {
+        stream->info.status.write_timeout = 1;
+        result = aio_cancel(stream->fd, &write.aio);
+        /* handle error */
+    }
+
+    if (stream->info.status.write_timeout ||
+        stream->info.status.error ||
+        stream->info.status.closed ||
+        stream->info.status.peer_closed ||
+        stream->info.status.shutdown)
+    {
+        stream->filters.head->on_status(stream->filters.head);
+        return 0;
+    }
+
+    return done;
+}
+
+static void io_file_writev_internal(io_work_t* work)
+{
+    io_file_writev_req_t* req = (io_file_writev_req_t*)work->arg;
+    ssize_t n;
+
+    while (req->iovcnt > 0)
+    {
+        n = pwritev(req->fd, req->iov, req->iovcnt, req->offset);
+        if (n > 0)
+        {
+            req->done += n;
+            req->offset += n;
+            req->iovcnt = io_stream_iov_consume(&req->iov, req->iovcnt, n);
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        req->error = n < 0 ? errno : EIO;
+        break;
+    }
+
+    io_loop_post_task(work->loop, work->task);
+}
+
+/*
+ * AIO has no vectored write, pwritev runs on the threadpool like opens.
+ * Timeouts do not apply, the call cannot be cancelled there
+ */
+static size_t io_stream_file_on_writev(io_filter_t* filter, const io_iovec_t* vectors, size_t count)
+{
+    io_stream_t* stream = filter->stream;
+    struct iovec iov[IO_STREAM_IOV];
+    io_file_writev_req_t write;
+    io_work_t work;
+    uint64_t start, end, elapsed;
+    size_t done = 0;
+    size_t length;
+    size_t used;
+
+#if IO_USE_URING
+    if (io_loop_uring(stream->loop))
+    {
+        return io_filter_on_writev(filter, vectors, count);
+    }
+#endif
+
+    if (stream->info.status.write_timeout ||
+        stream->info.status.error ||
+        stream->info.status.closed ||
+        stream->info.status.peer_closed ||
+        stream->info.status.shutdown)
+    {
+        return 0;
+    }
+
+    start = STOPWATCH_MEASURE();
+
+    while (count > 0)
+    {
+        used = io_stream_iov_fill(iov, &write.iovcnt, vectors, count, &length);
+        vectors += used;
+        count -= used;
+
+        if (write.iovcnt == 0)
+        {
+            continue;
+        }
+
+        write.fd = stream->fd;
+        write.iov = iov;
+        write.offset = (off_t)stream->impl.file.write_offset;
+        write.done = 0;
+        write.error = 0;
+
+        work.arg = &write;
+        work.entry = io_file_writev_internal;
+
+        io_threadpool_post(&work);
+        task_suspend(work.task);
+
+        stream->impl.file.write_offset += write.done;
+        done += write.done;
+
+        if (write.error)
+        {
+            stream->info.status.error = write.error;
+            stream->filters.head->on_status(stream->filters.head);
+            break;
+        }
+    }
+
+    end = STOPWATCH_MEASURE();
+    elapsed = STOPWATCH_NANOSECONDS(start, end);
+
+    stream->info.write.bytes += done;
+    stream->info.write.period += elapsed;
+    stream->info.write.count += 1;
+    io_stream_count(stream, 1, elapsed);
+
+    return done;
+}
+
+static void io_stream_on_status(io_filter_t* filter)
+{
+}
+
+static void io_stream_processor(io_stream_t* stream, int events)
+{
+    task_t* reader = (task_t*)stream->platform.read_req;
+    task_t* writer = (task_t*)stream->platform.write_req;
+
+    if (events == -1)
+    {
+        stream->info.status.shutdown = 1;
+        stream->filters.head->on_status(stream->filters.head);
+    }
+    else if (events & EPOLLERR)
+    {
+        stream->info.status.error = io_socket_error(stream->fd);
+        stream->filters.head->on_status(stream->filters.head);
+    }
+    else if (events & EPOLLHUP)
+    {
+        stream->info.status.closed = 1;
+        stream->filters.head->on_status(stream->filters.head);
+    }
+    else
+    {
+        // Peer shutdown is reported by read() once pending data is drained
+        if (events & (EPOLLIN | EPOLLPRI | EPOLLRDHUP))
+        {
+            stream->platform.readable = 1;
+        }
+
+        if (events & EPOLLOUT)
+        {
+            stream->platform.writable = 1;
+        }
+    }
+
+    /*
+     * Waiters are taken before resuming, a resumed task may
+     * close the stream
+     */
+
+    if (reader != 0 && (stream->platform.readable || io_stream_failed(stream)))
     {
-        return length;
+        task_resume(reader);
+    }
+    else
+    {
+        reader = 0;
     }
 
-    if (stream->info.status.read_timeout ||
-        stream->info.status.eof ||
-        stream->info.status.error ||
-        stream->info.status.closed ||
-        stream->info.status.peer_closed ||
-        stream->info.status.shutdown)
+    if (writer != 0 && writer != reader &&
+        (stream->platform.writable || io_stream_failed(stream)))
     {
-        return 0;
+        task_resume(writer);
     }
+}
 
-    memset(&read, 0, sizeof(io_file_read_req_t));
+/*
+ * Zero-copy pipe. Sockets wait for readiness like reads and writes do, with
+ * their timeouts applied per wait so long transfers are not cut short
+ */
 
-    read.aio.aio_fildes = stream->fd;
-    read.aio.aio_buf = buffer;
-    read.aio.aio_nbytes = length;
-    read.aio.aio_offset = stream->impl.file.read_offset;
-    read.aio.aio_sigevent.sigev_notify = SIGEV_THREAD;
-    read.aio.aio_sigevent.sigev_notify_function = io_file_read_completion_handler;
-    read.aio.aio_sigevent.sigev_notify_attributes = 0;
-    read.aio.aio_sigevent.sigev_value.sival_ptr = &read;
-    read.done = 0;
-    read.loop = stream->loop;
-    read.task = stream->loop->current;
+static void io_stream_pipe_fail(io_stream_t* stream, int error)
+{
+    stream->info.status.error = error;
+    stream->filters.head->on_status(stream->filters.head);
+}
 
-    result = aio_read(&read.aio);
+// Returns 0 when the stream timed out or failed meanwhile
+static int io_stream_pipe_wait(io_stream_t* stream, int events)
+{
+    moment_t timeout;
 
-    if (result == -1)
-    {
-        stream->info.status.error = errno;
-        stream->filters.head->on_status(stream->filters.head);
-        return 0;
-    }
+    timeout.time = 0;
+    timeout.reached = 0;
 
-    if (stream->info.read.timeout > 0)
-    {
-        timeout.time = time_current() + stream->info.read.timeout;
-        timeout.task = stream->loop->current;
+    io_stream_wait(stream, events, &timeout,
+                   events == IO_READ ? stream->info.read.timeout : stream->info.write.timeout);
+    io_stream_wait_done(stream, &timeout);
 
-        moments_add(&stream->loop->timeouts, &timeout);        
-    }
-    else
+    if (timeout.reached)
     {
-        timeout.time = 0;
+        if (events == IO_READ)
+            stream->info.status.read_timeout = 1;
+        else
+            stream->info.status.write_timeout = 1;
+
+        stream->filters.head->on_status(stream->filters.head);
+        return 0;
     }
 
-    start = stopwatch_measure();
+    return !io_stream_failed(stream);
+}
 
-    task_suspend(read.task);
+// Writes at the end of the file whatever the offset, which splice and
+// copy_file_range refuse
+static int io_stream_appends(io_stream_t* stream)
+{
+    int flags = fcntl(stream->fd, F_GETFL);
 
-    end = stopwatch_measure();
-    elapsed = stopwatch_nanoseconds(start, end);
+    return flags == -1 || (flags & O_APPEND) != 0;
+}
 
-    stream->info.read.bytes += read.done;
-    stream->info.read.period += elapsed;
+static int io_stream_sendfile(io_stream_t* from, io_stream_t* to, size_t chunk_size,
+                              uint64_t* moved)
+{
+    off_t offset = (off_t)from->impl.file.read_offset;
+    ssize_t n;
 
-    if (timeout.time > 0)
+    while (1)
     {
-        moments_remove(&stream->loop->timeouts, &timeout);
-    }
+        if (!to->platform.writable)
+        {
+            if (!io_stream_pipe_wait(to, IO_WRITE))
+                break;
+        }
 
-    if (timeout.time > 0 && timeout.reached)
-    {
-        stream->info.read.timeout = 1;
-        stream->filters.head->on_status(stream->filters.head);
+        // Pages not cached yet are read by the loop thread
+        n = sendfile(to->fd, from->fd, &offset, chunk_size);
+        if (n > 0)
+        {
+            *moved += n;
+            continue;
+        }
 
-        result = aio_cancel(stream->fd, &read.aio);
-        /* handle error */
+        if (n == 0)
+        {
+            from->info.status.eof = 1;
+            from->filters.head->on_status(from->filters.head);
+            break;
+        }
 
-        return 0;
-    }
-    else
-    {
-        stream->impl.file.read_offset += read.done;
-        if (read.done == 0)
+        if (errno == EINTR)
         {
-            stream->info.status.eof = 1;
+            continue;
         }
 
-        if (read.error)
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
         {
-            stream->info.status.error = read.error;
+            // Socket buffer is full, next edge sets it back
+            to->platform.writable = 0;
+            continue;
         }
 
-        if (read.done == 0 || read.error)
+        if (*moved == 0 && (errno == EINVAL || errno == ENOSYS))
         {
-            stream->filters.head->on_status(stream->filters.head);
+            // Not a regular file
+            return ENOTSUP;
         }
 
-        return read.done;
+        io_stream_pipe_fail(errno == EIO ? from : to, errno);
+        break;
     }
+
+    from->impl.file.read_offset = (uint64_t)offset;
+
+    return 0;
 }
 
-size_t io_stream_file_on_write(io_filter_t* filter, const char* buffer, size_t length)
+/*
+ * Sockets splice through a pipe, the loop keeps one spare so a pipe is not
+ * created per call. A pipe left with data, when the target failed, is closed
+ */
+static int io_stream_splice_pipe_take(io_loop_t* loop, int fds[2])
 {
-    io_stream_t* stream = filter->stream;
-    io_file_write_req_t write;
-    moment_t timeout;
-    uint64_t start, end, elapsed;
-    uint64_t done = 0;
-    int result;
-
-    if (stream->info.write.timeout > 0)
+    if (loop->splice[0] != -1)
     {
-        timeout.time = time_current() + stream->info.write.timeout;
-        timeout.task = stream->loop->current;
-
-        moments_add(&stream->loop->timeouts, &timeout);
+        fds[0] = loop->splice[0];
+        fds[1] = loop->splice[1];
+        loop->splice[0] = -1;
+        loop->splice[1] = -1;
+        return 0;
     }
-    else
+
+    if (-1 == pipe2(fds, O_NONBLOCK | O_CLOEXEC))
     {
-        timeout.time = 0;
+        return errno;
     }
 
-    start = stopwatch_measure();
+    return 0;
+}
 
-    do
+static void io_stream_splice_pipe_give(io_loop_t* loop, int fds[2], int empty)
+{
+    if (empty && loop->splice[0] == -1)
     {
-        memset(&write, 0, sizeof(io_file_write_req_t));
+        loop->splice[0] = fds[0];
+        loop->splice[1] = fds[1];
+        return;
+    }
 
-        write.aio.aio_fildes = stream->fd;
-        write.aio.aio_buf = (char*)buffer + done;
-        write.aio.aio_nbytes = length - done;
-        write.aio.aio_offset = stream->impl.file.write_offset;
-        write.aio.aio_sigevent.sigev_notify = SIGEV_THREAD;
-        write.aio.aio_sigevent.sigev_notify_function = io_file_write_completion_handler;
-        write.aio.aio_sigevent.sigev_notify_attributes = 0;
-        write.aio.aio_sigevent.sigev_value.sival_ptr = &write;
-        write.done = 0;
-        write.loop = stream->loop;
-        write.task = stream->loop->current;
+    io_close(fds[0]);
+    io_close(fds[1]);
+}
 
-        result = aio_write(&write.aio);
+static int io_stream_splice_through(io_stream_t* from, io_stream_t* to, size_t chunk_size,
+                                    uint64_t* received, uint64_t* moved)
+{
+    loff_t offset = (loff_t)to->impl.file.write_offset;
+    loff_t* to_offset = to->info.type == IO_STREAM_FILE ? &offset : 0;
+    size_t buffered = 0;
+    ssize_t n;
+    int fds[2];
 
-        if (result == -1)
+    if (io_stream_splice_pipe_take(from->loop, fds))
+    {
+        return ENOTSUP;
+    }
+
+    while (1)
+    {
+        if (buffered == 0)
         {
-            stream->info.status.error = errno;
-            stream->filters.head->on_status(stream->filters.head);
-            break;
+            if (!from->platform.readable)
+            {
+                if (!io_stream_pipe_wait(from, IO_READ))
+                    break;
+            }
+
+            n = splice(from->fd, 0, fds[1], 0, chunk_size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0)
+            {
+                from->info.status.eof = 1;
+                from->filters.head->on_status(from->filters.head);
+                break;
+            }
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    // Drained, the pipe is empty here
+                    from->platform.readable = 0;
+                    continue;
+                }
+
+                if (*received == 0 && errno == EINVAL)
+                {
+                    io_stream_splice_pipe_give(from->loop, fds, 1);
+                    return ENOTSUP;
+                }
+
+                io_stream_pipe_fail(from, errno);
+                break;
+            }
+
+            buffered = n;
+            *received += n;
         }
 
-        task_suspend(write.task);
-
-        if (atomic_load64(&stream->loop->shutdown))
+        if (to_offset == 0 && !to->platform.writable)
         {
-            stream->info.status.shutdown = 1;
-            stream->filters.head->on_status(stream->filters.head);
-            break;
+            if (!io_stream_pipe_wait(to, IO_WRITE))
+                break;
         }
 
-        if (stream->info.status.write_timeout ||
-            stream->info.status.error ||
-            stream->info.status.closed ||
-            stream->info.status.peer_closed ||
-            stream->info.status.shutdown)
+        n = splice(fds[0], 0, to->fd, to_offset, buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
         {
-            break;
+            buffered -= n;
+            *moved += n;
+            continue;
         }
 
-        if (timeout.time > 0 && timeout.reached)
+        if (n < 0 && errno == EINTR)
         {
-            break;
+            continue;
         }
 
-        if (write.error != 0)
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && to_offset == 0)
         {
-            stream->info.status.error = write.error;
-            stream->filters.head->on_status(stream->filters.head);
-            break;
+            to->platform.writable = 0;
+            continue;
         }
 
-        stream->impl.file.write_offset += write.done;
-        done += write.done;
+        io_stream_pipe_fail(to, n < 0 ? errno : EIO);
+        break;
+    }
 
+    if (to_offset != 0)
+    {
+        to->impl.file.write_offset = (uint64_t)offset;
     }
-    while (done < length);
 
-    end = stopwatch_measure();
-    elapsed = stopwatch_nanoseconds(start, end);
+    io_stream_splice_pipe_give(from->loop, fds, buffered == 0);
 
-    stream->info.write.bytes += done;
-    stream->info.write.period += elapsed;
+    return 0;
+}
 
-    if (timeout.time > 0)
+static void io_file_copy_internal(io_work_t* work)
+{
+    io_file_copy_req_t* req = (io_file_copy_req_t*)work->arg;
+    ssize_t n;
+
+    while (1)
     {
-        moments_remove(&stream->loop->timeouts, &timeout);
+        n = copy_file_range(req->from, &req->from_offset, req->to, &req->to_offset,
+                            req->chunk_size, 0);
+        if (n > 0)
+        {
+            req->done += n;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        req->error = n < 0 ? errno : 0;
+        break;
     }
 
-    if (timeout.time > 0 && timeout.reached)
+    io_loop_post_task(work->loop, work->task);
+}
+
+// Copies on the threadpool like opens, within the filesystem when it can
+static int io_stream_copy_file_range(io_stream_t* from, io_stream_t* to, size_t chunk_size,
+                                     uint64_t* moved)
+{
+    io_work_t work;
+    io_file_copy_req_t copy;
+
+    copy.from = from->fd;
+    copy.to = to->fd;
+    copy.from_offset = (loff_t)from->impl.file.read_offset;
+    copy.to_offset = (loff_t)to->impl.file.write_offset;
+    copy.chunk_size = chunk_size;
+    copy.done = 0;
+    copy.error = 0;
+
+    work.arg = &copy;
+    work.entry = io_file_copy_internal;
+
+    io_threadpool_post(&work);
+    task_suspend(work.task);
+
+    if (copy.done == 0 && (copy.error == EXDEV || copy.error == EINVAL ||
+                           copy.error == ENOSYS || copy.error == EOPNOTSUPP))
     {
-        stream->info.status.write_timeout = 1;
-        result = aio_cancel(stream->fd, &write.aio);
-        /* handle error */
+        // Older kernels copy within one filesystem only
+        return ENOTSUP;
     }
 
-    if (stream->info.status.write_timeout ||
-        stream->info.status.error ||
-        stream->info.status.closed ||
-        stream->info.status.peer_closed ||
-        stream->info.status.shutdown)
+    from->impl.file.read_offset = (uint64_t)copy.from_offset;
+    to->impl.file.write_offset = (uint64_t)copy.to_offset;
+    *moved = copy.done;
+
+    if (copy.error)
     {
-        stream->filters.head->on_status(stream->filters.head);
-        return 0;
+        io_stream_pipe_fail(copy.error == EIO ? from : to, copy.error);
+    }
+    else
+    {
+        from->info.status.eof = 1;
+        from->filters.head->on_status(from->filters.head);
     }
 
-    return done;
+    return 0;
 }
 
-static void io_stream_on_status(io_filter_t* filter)
-{
-}
+/*
+ * Internal API
+ */
 
-static void io_stream_processor(io_stream_t* stream, int events)
+int io_stream_pipe_direct(io_stream_t* from, io_stream_t* to, size_t chunk_size,
+                          size_t* transferred)
 {
-    task_t* task = 0;
+    uint64_t start, elapsed;
+    uint64_t received = 0;
+    uint64_t moved = 0;
+    int error = ENOTSUP;
 
-    if (events == -1)
+    if (from->info.type != IO_STREAM_FILE && from->info.type != IO_STREAM_TCP)
     {
-        stream->info.status.shutdown = 1;
-        stream->filters.head->on_status(stream->filters.head);
+        return ENOTSUP;
     }
-    else if (events & EPOLLERR)
+
+    if (to->info.type != IO_STREAM_FILE && to->info.type != IO_STREAM_TCP)
     {
-        stream->info.status.error = errno;
-        stream->filters.head->on_status(stream->filters.head);
+        return ENOTSUP;
     }
-    else if (events & EPOLLHUP)
+
+    if (io_stream_attach(from) || io_stream_attach(to) || from->loop != to->loop ||
+        io_loop_uring(from->loop))
     {
-        stream->info.status.closed = 1;
-        stream->filters.head->on_status(stream->filters.head);
+        // Failures are reported by the plain copy, the ring has no readiness
+        return ENOTSUP;
     }
-    else if (events & EPOLLRDHUP)
+
+    if (to->info.type == IO_STREAM_FILE && io_stream_appends(to))
     {
-        stream->info.status.peer_closed = 1;
-        stream->filters.head->on_status(stream->filters.head);
+        return ENOTSUP;
     }
-    else
+
+    if (from->info.status.read_timeout || from->info.status.eof || io_stream_failed(from) ||
+        to->info.status.write_timeout || io_stream_failed(to))
     {
-        if ((events & EPOLLIN) || (events & EPOLLPRI))
-        {
-            io_stream_read_try(stream);
-            task = ((io_tcp_read_req_t*)stream->platform.read_req)->task;
-        }
-        else
-        if (events & EPOLLOUT)
-        {
-            io_stream_write_try(stream);
-            task = ((io_tcp_write_req_t*)stream->platform.write_req)->task;
-        }
-        else
-        {
-            stream->info.status.error = errno;
-            stream->filters.head->on_status(stream->filters.head);
-        }
+        return 0;
+    }
+
+    if (!io_stream_ahead_flush(from, to, transferred))
+    {
+        return 0;
     }
 
-    if (task == 0 && stream->platform.read_req != 0)
+    // Nothing is buffered here, the chunk only bounds a single call
+    if (chunk_size < IO_STREAM_PIPE_CHUNK)
     {
-        task = ((io_tcp_read_req_t*)stream->platform.read_req)->task;
+        chunk_size = IO_STREAM_PIPE_CHUNK;
     }
 
-    if (task == 0 && stream->platform.write_req != 0)
+    start = STOPWATCH_MEASURE();
+
+    if (from->info.type == IO_STREAM_FILE && to->info.type == IO_STREAM_TCP)
+    {
+        error = io_stream_sendfile(from, to, chunk_size, &moved);
+        received = moved;
+    }
+    else if (from->info.type == IO_STREAM_TCP)
+    {
+        error = io_stream_splice_through(from, to, chunk_size, &received, &moved);
+    }
+    else
     {
-        task = ((io_tcp_write_req_t*)stream->platform.write_req)->task;
+        error = io_stream_copy_file_range(from, to, chunk_size, &moved);
+        received = moved;
     }
 
-    if (task != 0)
+    if (error)
     {
-        task_resume(task);
+        return error;
     }
+
+    elapsed = STOPWATCH_NANOSECONDS(start, STOPWATCH_MEASURE());
+
+    from->info.read.count += 1;
+    from->info.read.bytes += received;
+    from->info.read.period += elapsed;
+    io_stream_count(from, 0, elapsed);
+
+    to->info.write.count += 1;
+    to->info.write.bytes += moved;
+    to->info.write.period += elapsed;
+    io_stream_count(to, 1, elapsed);
+
+    *transferred += (size_t)moved;
+
+    return 0;
 }
 
 /*
@@ -623,16 +1607,35 @@ int io_stream_attach(io_stream_t* stream)
 
     if (atomic_load64(&stream->loop->shutdown))
     {
+        // No reference taken, close must not release one
+        stream->loop = 0;
         stream->info.status.shutdown = 1;
         stream->filters.head->on_status(stream->filters.head);
         return ECANCELED;
     }
 
-    if (stream->info.type == IO_STREAM_TCP)
+    if (stream->info.type == IO_STREAM_TCP && !io_loop_uring(stream->loop))
     {
-        stream->platform.e.events = EPOLLERR | EPOLLHUP | EPOLLRDHUP;
-        error = epoll_ctl(stream->loop->epoll, EPOLL_CTL_ADD, stream->fd,
-                            &stream->platform.e);
+        /*
+         * Registered once, edge-triggered. Readiness is tracked in the stream
+         * and syscalls are tried first, so no epoll_ctl is needed per operation
+         */
+        stream->platform.e.events = IO_STREAM_EVENTS;
+        stream->platform.readable = 1;
+        stream->platform.writable = 1;
+
+        if (-1 == epoll_ctl(stream->loop->epoll, EPOLL_CTL_ADD, stream->fd,
+                            &stream->platform.e))
+        {
+            error = errno;
+        }
+
+        if (!error && stream->loop->busy_poll > 0)
+        {
+            // Best effort, raising it above net.core.busy_read needs CAP_NET_ADMIN
+            int busy_poll = stream->loop->busy_poll > INT_MAX ? INT_MAX : (int)stream->loop->busy_poll;
+            setsockopt(stream->fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+        }
     }
     
     if (error)
@@ -660,10 +1663,14 @@ void io_stream_init(io_stream_t* stream)
     case IO_STREAM_FILE:
         stream->operations.on_read = io_stream_file_on_read;
         stream->operations.on_write = io_stream_file_on_write;
+        stream->operations.on_readv = io_stream_file_on_readv;
+        stream->operations.on_writev = io_stream_file_on_writev;
         break;
     case IO_STREAM_TCP:
         stream->operations.on_read = io_stream_tcp_on_read;
         stream->operations.on_write = io_stream_tcp_on_write;
+        stream->operations.on_readv = io_stream_tcp_on_readv;
+        stream->operations.on_writev = io_stream_tcp_on_writev;
         break;
     case IO_STREAM_UDP:
         break;
@@ -684,13 +1691,12 @@ int io_stream_close(io_stream_t* stream)
 {
     int error = 0;
 
+    // Corked bytes go out before the descriptor does
+    io_stream_flush(stream);
+
     if (stream->info.type == IO_STREAM_MEMORY)
     {
-        io_memory_chunk_t* chunk = LIST_HEAD((&stream->impl.memory));
-        while (chunk) {
-            io_free(chunk);
-            chunk = LIST_HEAD((&stream->impl.memory));
-        }
+        io_stream_memory_cleanup(stream);
     }
     else if (stream->info.type == IO_STREAM_FILE)
     {
@@ -701,8 +1707,11 @@ int io_stream_close(io_stream_t* stream)
     {
         if (stream->loop != 0)
         {
-            error = epoll_ctl(stream->loop->epoll, EPOLL_CTL_DEL, stream->fd,
-                                &stream->platform.e);
+            if (!io_loop_uring(stream->loop))
+            {
+                error = epoll_ctl(stream->loop->epoll, EPOLL_CTL_DEL, stream->fd,
+                                    &stream->platform.e);
+            }
 
             io_loop_unref(stream->loop);
 
@@ -718,10 +1727,12 @@ int io_stream_close(io_stream_t* stream)
 
     stream->filters.head->on_status(stream->filters.head);
 
-    if (stream->unread.length > 0) 
+    if (stream->ahead.buffer != 0)
     {
-        io_free(stream->unread.buffer);
-        stream->unread.length = 0;
+        io_free(stream->ahead.buffer);
+        stream->ahead.buffer = 0;
+        stream->ahead.length = 0;
+        stream->ahead.size = 0;
     }
 
     if (stream->loop != 0)
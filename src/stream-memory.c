@@ -0,0 +1,289 @@
+/* Copyright (c) 2018, Artak Khnkoyan <artak.khnkoyan@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stddef.h> // offsetof
+#include "memory.h"
+#include "stream.h"
+
+typedef struct io_memory_block_t {
+    size_t refs;                // chunks viewing the data
+    size_t size;
+    size_t used;                // bytes written so far
+    io_memory_chunk_t chunk;    // first view, saves an allocation
+    char data[1];
+} io_memory_block_t;
+
+static io_memory_chunk_t* io_memory_chunk_create(size_t size)
+{
+    io_memory_block_t* block;
+
+    block = (io_memory_block_t*)io_malloc(offsetof(io_memory_block_t, data) + size);
+    if (block == 0)
+    {
+        return 0;
+    }
+
+    block->refs = 1;
+    block->size = size;
+    block->used = 0;
+    block->chunk.block = block;
+    block->chunk.offset = 0;
+    block->chunk.length = 0;
+
+    return &block->chunk;
+}
+
+// Another view of the first length bytes of the chunk
+static io_memory_chunk_t* io_memory_chunk_share(io_memory_chunk_t* chunk, size_t length)
+{
+    io_memory_chunk_t* shared;
+
+    shared = (io_memory_chunk_t*)io_malloc(sizeof(io_memory_chunk_t));
+    if (shared == 0)
+    {
+        return 0;
+    }
+
+    shared->block = chunk->block;
+    shared->offset = chunk->offset;
+    shared->length = length;
+    shared->block->refs++;
+
+    return shared;
+}
+
+static void io_memory_chunk_release(io_memory_chunk_t* chunk)
+{
+    io_memory_block_t* block = chunk->block;
+
+    if (chunk != &block->chunk)
+    {
+        io_free(chunk);
+    }
+
+    if (--block->refs == 0)
+    {
+        io_free(block);
+    }
+}
+
+// Bytes may be added in place only while nobody else views the block
+static size_t io_memory_chunk_room(io_memory_chunk_t* chunk)
+{
+    io_memory_block_t* block = chunk->block;
+
+    if (block->refs != 1 || chunk->offset + chunk->length != block->used)
+    {
+        return 0;
+    }
+
+    return block->size - block->used;
+}
+
+static size_t io_stream_memory_on_read(io_filter_t* filter, char* buffer, size_t length)
+{
+    io_stream_t* stream = filter->stream;
+    io_memory_chunk_t* chunk = LIST_HEAD((&stream->impl.memory));
+    size_t offset = 0;
+    size_t n;
+
+    while (chunk != 0 && offset < length)
+    {
+        n = length - offset < chunk->length ? length - offset : chunk->length;
+
+        memcpy(buffer + offset, chunk->block->data + chunk->offset, n);
+        offset += n;
+
+        chunk = chunk->next;
+    }
+
+    return io_stream_memory_consume(stream, offset);
+}
+
+static size_t io_stream_memory_on_write(io_filter_t* filter, const char* buffer, size_t length)
+{
+    io_stream_t* stream = filter->stream;
+    io_memory_chunk_t* chunk = LIST_TAIL((&stream->impl.memory));
+    size_t offset = 0;
+    size_t room;
+    size_t n;
+
+    while (offset < length)
+    {
+        room = chunk ? io_memory_chunk_room(chunk) : 0;
+        if (room == 0)
+        {
+            chunk = io_memory_chunk_create((size_t)stream->impl.memory.bucket_size);
+            if (chunk == 0)
+            {
+                stream->info.status.error = ENOMEM;
+                break;
+            }
+
+            LIST_PUSH_TAIL((&stream->impl.memory), chunk);
+            room = chunk->block->size;
+        }
+
+        n = length - offset < room ? length - offset : room;
+
+        memcpy(chunk->block->data + chunk->block->used, buffer + offset, n);
+        chunk->block->used += n;
+        chunk->length += n;
+        offset += n;
+    }
+
+    stream->impl.memory.length += offset;
+
+    return offset;
+}
+
+static void io_stream_memory_on_status(io_filter_t* filter)
+{
+    (void)filter;
+}
+
+/*
+ * Internal API
+ */
+
+void io_stream_memory_init(io_stream_t* stream)
+{
+    io_filter_attach(&stream->operations, stream);
+
+    stream->operations.on_status = io_stream_memory_on_status;
+    stream->operations.on_read = io_stream_memory_on_read;
+    stream->operations.on_write = io_stream_memory_on_write;
+}
+
+void io_stream_memory_cleanup(io_stream_t* stream)
+{
+    io_memory_chunk_t* chunk = LIST_HEAD((&stream->impl.memory));
+
+    while (chunk != 0)
+    {
+        LIST_POP_HEAD((&stream->impl.memory));
+        io_memory_chunk_release(chunk);
+
+        chunk = LIST_HEAD((&stream->impl.memory));
+    }
+
+    stream->impl.memory.length = 0;
+}
+
+size_t io_stream_memory_peek(io_stream_t* stream, io_iovec_t* vectors, size_t count)
+{
+    io_memory_chunk_t* chunk = LIST_HEAD((&stream->impl.memory));
+    size_t i = 0;
+
+    for (; chunk != 0 && i < count; chunk = chunk->next)
+    {
+        if (chunk->length == 0)
+        {
+            continue;
+        }
+
+        vectors[i].buffer = chunk->block->data + chunk->offset;
+        vectors[i].length = chunk->length;
+        i++;
+    }
+
+    return i;
+}
+
+size_t io_stream_memory_consume(io_stream_t* stream, size_t length)
+{
+    io_memory_chunk_t* chunk = LIST_HEAD((&stream->impl.memory));
+    size_t done = 0;
+    size_t n;
+
+    while (chunk != 0 && done < length)
+    {
+        n = length - done < chunk->length ? length - done : chunk->length;
+
+        chunk->offset += n;
+        chunk->length -= n;
+        done += n;
+
+        // The tail stays to be appended to
+        if (chunk->length > 0 || (chunk == LIST_TAIL((&stream->impl.memory)) &&
+                                  io_memory_chunk_room(chunk) > 0))
+        {
+            break;
+        }
+
+        LIST_POP_HEAD((&stream->impl.memory));
+        io_memory_chunk_release(chunk);
+
+        chunk = LIST_HEAD((&stream->impl.memory));
+    }
+
+    stream->impl.memory.length -= done;
+
+    return done;
+}
+
+size_t io_stream_memory_splice(io_stream_t* from, io_stream_t* to, size_t length)
+{
+    io_memory_chunk_t* chunk = LIST_HEAD((&from->impl.memory));
+    io_memory_chunk_t* shared;
+    size_t done = 0;
+
+    while (chunk != 0 && done < length)
+    {
+        if (chunk->length > length - done)
+        {
+            // Split, both streams view the same block
+            shared = io_memory_chunk_share(chunk, length - done);
+            if (shared == 0)
+            {
+                to->info.status.error = ENOMEM;
+                break;
+            }
+
+            LIST_PUSH_TAIL((&to->impl.memory), shared);
+            done += shared->length;
+
+            chunk->offset += shared->length;
+            chunk->length -= shared->length;
+            break;
+        }
+
+        LIST_POP_HEAD((&from->impl.memory));
+
+        if (chunk->length > 0)
+        {
+            LIST_PUSH_TAIL((&to->impl.memory), chunk);
+            done += chunk->length;
+        }
+        else
+        {
+            io_memory_chunk_release(chunk);
+        }
+
+        chunk = LIST_HEAD((&from->impl.memory));
+    }
+
+    from->impl.memory.length -= done;
+    to->impl.memory.length += done;
+
+    return done;
+}
\ No newline at end of file
@@ -19,6 +19,7 @@
  * IN THE SOFTWARE.
  */
 
+#include <errno.h>
 #include "memory.h"
 #include "task.h"
 #include "time.h"
@@ -65,17 +66,17 @@ size_t io_stream_on_read(io_filter_t* filter, char* buffer, size_t length)
 
 	if (stream->info.write.timeout > 0)
 	{
-		timeout.time = time_current() + stream->info.write.timeout;
+		timeout.time = stream->loop->now + stream->info.write.timeout;
 		timeout.task = stream->loop->current;
 
-		moments_add(&stream->loop->timeouts, &timeout);
+		moments_add(&stream->loop->timeouts, &timeout, stream->loop->now);
 	}
 	else
 	{
 		timeout.time = 0;
 	}
 
-	start = stopwatch_measure();
+	start = STOPWATCH_MEASURE();
 
 	switch (stream->info.type) {
 		case IO_STREAM_FILE: {
@@ -145,11 +146,12 @@ size_t io_stream_on_read(io_filter_t* filter, char* buffer, size_t length)
 		task_suspend(read.task);
 	}
 
-	end = stopwatch_measure();
-	elapsed = stopwatch_nanoseconds(start, end);
+	end = STOPWATCH_MEASURE();
+	elapsed = STOPWATCH_NANOSECONDS(start, end);
 
 	stream->info.read.bytes += read.done;
 	stream->info.read.period += elapsed;
+	io_stream_latency_record(stream, 0, elapsed);
 
 	if (timeout.time > 0)
 	{
@@ -214,17 +216,17 @@ size_t io_stream_on_write(io_filter_t* filter, const char* buffer, size_t length
 
 	if (stream->info.write.timeout > 0)
 	{
-		timeout.time = time_current() + stream->info.write.timeout;
+		timeout.time = stream->loop->now + stream->info.write.timeout;
 		timeout.task = stream->loop->current;
 
-		moments_add(&stream->loop->timeouts, &timeout);
+		moments_add(&stream->loop->timeouts, &timeout, stream->loop->now);
 	}
 	else
 	{
 		timeout.time = 0;
 	}
 
-	start = stopwatch_measure();
+	start = STOPWATCH_MEASURE();
 
 	do
 	{
@@ -320,11 +322,12 @@ size_t io_stream_on_write(io_filter_t* filter, const char* buffer, size_t length
 	}
 	while (offset < length && write.done > 0);
 
-	end = stopwatch_measure();
-	elapsed = stopwatch_nanoseconds(start, end);
+	end = STOPWATCH_MEASURE();
+	elapsed = STOPWATCH_NANOSECONDS(start, end);
 
 	stream->info.write.bytes += write.done;
 	stream->info.write.period += elapsed;
+	io_stream_latency_record(stream, 1, elapsed);
 
 	if (timeout.time > 0)
 	{
@@ -410,6 +413,8 @@ int io_stream_attach(io_stream_t* stream)
 
 	if (atomic_load64(&stream->loop->shutdown))
 	{
+		// No reference taken, close must not release one
+		stream->loop = 0;
 		stream->info.status.shutdown = 1;
 		stream->filters.head->on_status(stream->filters.head);
 		return ECANCELED;
@@ -456,6 +461,13 @@ void io_stream_init(io_stream_t* stream)
 	stream->operations.on_write = io_stream_on_write;
 }
 
+int io_stream_pipe_direct(io_stream_t* from, io_stream_t* to, size_t chunk_size,
+	size_t* transferred)
+{
+	// TransmitFile would serve file to socket, plain copy for now
+	return ENOTSUP;
+}
+
 /*
  * Public API
  */
@@ -469,7 +481,13 @@ int io_stream_close(io_stream_t* stream)
 		return 0;
 	}
 
-	if (stream->info.type == IO_STREAM_FILE)
+	io_stream_flush(stream);
+
+	if (stream->info.type == IO_STREAM_MEMORY)
+	{
+		io_stream_memory_cleanup(stream);
+	}
+	else if (stream->info.type == IO_STREAM_FILE)
 	{
 		stream->info.status.closed = 1;
 		io_file_close(stream);
@@ -484,10 +502,12 @@ int io_stream_close(io_stream_t* stream)
 
 	stream->filters.head->on_status(stream->filters.head);
 
-	if (stream->unread.length > 0)
+	if (stream->ahead.buffer != 0)
 	{
-		io_free(stream->unread.buffer);
-		stream->unread.length = 0;
+		io_free(stream->ahead.buffer);
+		stream->ahead.buffer = 0;
+		stream->ahead.length = 0;
+		stream->ahead.size = 0;
 	}
 
 	if (stream->loop != 0)
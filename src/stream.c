@@ -19,6 +19,7 @@
  * IN THE SOFTWARE.
  */
 
+#include <errno.h>
 #include "memory.h"
 #include "stream.h"
 
@@ -30,27 +31,337 @@ int io_stream_create(io_stream_t** stream)
         return errno;
     }
 
+    (*stream)->info.type = IO_STREAM_MEMORY;
     (*stream)->impl.memory.bucket_size = 64 * 1024;
 
+    io_stream_memory_init(*stream);
+
+    return 0;
+}
+
+#define IO_STREAM_PIPE_VECTORS 16
+#define IO_STREAM_AHEAD_SIZE (8 * 1024)
+
+// Streams without filters may move data without copies through userspace
+static int io_stream_unfiltered(io_stream_t* stream)
+{
+    return stream->filters.head == &stream->operations;
+}
+
+static void io_stream_cork_release(io_stream_t* stream)
+{
+    io_pool_free(&stream->loop->buffers, stream->cork.buffer);
+
+    stream->cork.buffer = 0;
+    stream->cork.length = 0;
+}
+
+// Sends pending bytes followed by the given ones, returns how many of the given were sent
+static size_t io_stream_cork_send(io_stream_t* stream, const char* buffer, size_t length)
+{
+    io_iovec_t vectors[2];
+    size_t pending = stream->cork.length;
+    size_t n;
+
+    vectors[0].buffer = stream->cork.buffer;
+    vectors[0].length = pending;
+    vectors[1].buffer = (char*)buffer;
+    vectors[1].length = length;
+
+    n = stream->filters.head->on_writev(stream->filters.head, vectors, 2);
+
+    io_stream_cork_release(stream);
+
+    return n > pending ? n - pending : 0;
+}
+
+static int io_stream_cork_flush(io_stream_t* stream)
+{
+    size_t pending = stream->cork.length;
+    size_t n;
+
+    n = stream->filters.head->on_write(stream->filters.head, stream->cork.buffer, pending);
+
+    io_stream_cork_release(stream);
+
+    if (n == pending)
+    {
+        return 0;
+    }
+
+    return stream->info.status.error ? stream->info.status.error : EIO;
+}
+
+static size_t io_stream_cork_write(io_stream_t* stream, const char* buffer, size_t length)
+{
+    io_pool_t* pool = &stream->loop->buffers;
+
+    if (stream->cork.length + length > pool->block_size)
+    {
+        return stream->cork.length > 0 ?
+            io_stream_cork_send(stream, buffer, length) :
+            stream->filters.head->on_write(stream->filters.head, buffer, length);
+    }
+
+    if (stream->cork.buffer == 0)
+    {
+        stream->cork.buffer = (char*)io_pool_alloc(pool);
+        if (stream->cork.buffer == 0)
+        {
+            return stream->filters.head->on_write(stream->filters.head, buffer, length);
+        }
+    }
+
+    memcpy(stream->cork.buffer + stream->cork.length, buffer, length);
+    stream->cork.length += length;
+
+    if (stream->cork.length == pool->block_size && io_stream_cork_flush(stream) != 0)
+    {
+        return 0;
+    }
+
+    return length;
+}
+
+/*
+ * Checks done before every read reaching the filters, 0 when the stream
+ * cannot be read
+ */
+static int io_stream_read_ready(io_stream_t* stream)
+{
+    int error;
+
+    if (stream->info.status.read_timeout ||
+        stream->info.status.error ||
+        stream->info.status.eof ||
+        stream->info.status.closed ||
+        stream->info.status.peer_closed ||
+        stream->info.status.shutdown)
+    {
+        return 0;
+    }
+
+    error = io_stream_attach(stream);
+    if (error)
+    {
+        stream->info.status.error = error;
+        return 0;
+    }
+
+    if (atomic_load64(&stream->loop->shutdown))
+    {
+        stream->info.status.shutdown = 1;
+        stream->filters.head->on_status(stream->filters.head);
+        return 0;
+    }
+
+    if (stream->cork.length > 0)
+    {
+        io_stream_cork_flush(stream);
+    }
+
+    return 1;
+}
+
+static size_t io_stream_ahead_read(io_stream_t* stream, char* buffer, size_t length)
+{
+    size_t n = length < stream->ahead.length ? length : stream->ahead.length;
+
+    memcpy(buffer, stream->ahead.buffer + stream->ahead.offset, n);
+    io_stream_ahead_drop(stream, n);
+
+    return n;
+}
+
+/*
+ * Makes room for length bytes counted from the first buffered one. The
+ * buffer is kept for the life of the stream, so it grows rarely
+ */
+static int io_stream_ahead_reserve(io_stream_t* stream, size_t length)
+{
+    char* buffer;
+    size_t size;
+
+    if (length <= stream->ahead.size - stream->ahead.offset)
+    {
+        return 0;
+    }
+
+    if (stream->ahead.offset > 0)
+    {
+        memmove(stream->ahead.buffer, stream->ahead.buffer + stream->ahead.offset,
+                stream->ahead.length);
+        stream->ahead.offset = 0;
+
+        if (length <= stream->ahead.size)
+        {
+            return 0;
+        }
+    }
+
+    size = stream->ahead.size * 2;
+    if (size < length)
+    {
+        size = length;
+    }
+
+    buffer = (char*)io_realloc(stream->ahead.buffer, size);
+    if (buffer == 0)
+    {
+        return ENOMEM;
+    }
+
+    stream->ahead.buffer = buffer;
+    stream->ahead.size = size;
+
+    return 0;
+}
+
+// Reads once from the filters behind the buffered bytes
+static size_t io_stream_ahead_fill(io_stream_t* stream, size_t length)
+{
+    size_t end;
+    size_t n;
+
+    if (!io_stream_read_ready(stream))
+    {
+        return 0;
+    }
+
+    if (io_stream_ahead_reserve(stream, stream->ahead.length + length) != 0)
+    {
+        stream->info.status.error = ENOMEM;
+        return 0;
+    }
+
+    end = stream->ahead.offset + stream->ahead.length;
+
+    n = stream->filters.head->on_read(stream->filters.head, stream->ahead.buffer + end,
+                                      stream->ahead.size - end);
+    stream->ahead.length += n;
+
+    return n;
+}
+
+// First delimiter in data, memchr finds the candidates
+static const char* io_stream_search(const char* data, size_t length,
+                                    const char* delimiter, size_t delimiter_length)
+{
+    const char* end;
+    const char* p = data;
+
+    if (delimiter_length > length)
+    {
+        return 0;
+    }
+
+    end = data + length - delimiter_length + 1;
+
+    while (p < end)
+    {
+        p = (const char*)memchr(p, delimiter[0], end - p);
+        if (p == 0)
+        {
+            return 0;
+        }
+
+        if (memcmp(p + 1, delimiter + 1, delimiter_length - 1) == 0)
+        {
+            return p;
+        }
+
+        p++;
+    }
+
     return 0;
 }
 
+/*
+ * Chunks of a memory stream are written in place, a vector per chunk
+ */
+static int io_stream_pipe_memory(io_stream_t* from, io_stream_t* to, size_t* transferred)
+{
+    io_iovec_t vectors[IO_STREAM_PIPE_VECTORS];
+    size_t n_transferred = 0;
+    size_t length;
+    size_t count;
+    size_t n;
+    size_t i;
+
+    count = io_stream_peek(from, vectors, IO_STREAM_PIPE_VECTORS);
+    while (count > 0)
+    {
+        for (i = 0, length = 0; i < count; ++i)
+        {
+            length += vectors[i].length;
+        }
+
+        n = io_stream_writev(to, vectors, count);
+        n_transferred += io_stream_consume(from, n);
+
+        if (n < length)
+        {
+            // write failed
+            break;
+        }
+
+        count = io_stream_peek(from, vectors, IO_STREAM_PIPE_VECTORS);
+    }
+
+    if (transferred)
+        *transferred = n_transferred;
+
+    return to->info.status.error;
+}
+
 int io_stream_pipe(io_stream_t* from, io_stream_t* to, size_t chunk_size, size_t* transferred)
 {
+    size_t n_transferred = 0;
+    int error;
+
     if (chunk_size < 64)
     {
         chunk_size = 8 * 1024;
     }
 
-    // if (from->type == IO_STREAM_MEMORY || to->type == IO_STREAM_MEMORY)
+    if (io_stream_unfiltered(from) && from->info.type == IO_STREAM_MEMORY)
+    {
+        if (io_stream_unfiltered(to) && to->info.type == IO_STREAM_MEMORY)
+        {
+            return io_stream_splice(from, to, (size_t)-1, transferred);
+        }
+
+        return io_stream_pipe_memory(from, to, transferred);
+    }
+
+    if (io_stream_unfiltered(from) && io_stream_unfiltered(to))
     {
-        // In place copy, when at least one of streams is a memory stream
+        error = io_stream_flush(to);
+        if (error)
+        {
+            if (transferred)
+                *transferred = 0;
+
+            return error;
+        }
+
+        error = io_stream_pipe_direct(from, to, chunk_size, &n_transferred);
+        if (error != ENOTSUP)
+        {
+            if (transferred)
+                *transferred = n_transferred;
+
+            return to->info.status.error;
+        }
+    }
+
+    {
+        // In place copy, when filters or memory streams are involved
         // ToDo: needs optimization in case of memory=>memory
 
         char* buffer = (char*)io_malloc(chunk_size);
         size_t n_read;
         size_t n_wrote;
-        size_t n_transferred = 0;
 
         n_read = io_stream_read(from, buffer, chunk_size, 0);
         while (n_read > 0)
@@ -61,12 +372,7 @@ int io_stream_pipe(io_stream_t* from, io_stream_t* to, size_t chunk_size, size_t
             if (n_wrote < n_read)
             {
                 // write failed
-
-                if (transferred)
-                    *transferred = n_transferred;
-
-                io_free(buffer);
-                return to->info.status.error;
+                break;
             }
 
             n_read = io_stream_read(from, buffer, chunk_size, 0);
@@ -74,6 +380,9 @@ int io_stream_pipe(io_stream_t* from, io_stream_t* to, size_t chunk_size, size_t
 
         // read completed or failed
 
+        if (transferred)
+            *transferred = n_transferred;
+
         io_free(buffer);
         return to->info.status.error;
     }
@@ -86,11 +395,30 @@ int io_stream_info(io_stream_t* stream, io_stream_info_t** info)
     return 0;
 }
 
-size_t io_stream_read(io_stream_t* stream, char* buffer, size_t length, int exact)
+int io_stream_latency(io_stream_t* stream, io_latency_type_t type,
+                      double percentile, uint64_t* nanoseconds)
 {
-	size_t done = 0;
-	int error;
+    *nanoseconds = 0;
 
+#if IO_STREAM_LATENCY
+    switch (type)
+    {
+    case IO_LATENCY_READ:
+        *nanoseconds = histogram_percentile(&stream->latency.read, percentile);
+        return 0;
+    case IO_LATENCY_WRITE:
+        *nanoseconds = histogram_percentile(&stream->latency.write, percentile);
+        return 0;
+    default:
+        return EINVAL;
+    }
+#else
+    return ENOTSUP;
+#endif
+}
+
+size_t io_stream_read(io_stream_t* stream, char* buffer, size_t length, int exact)
+{
 	if (length == 0)
 	{
 		return length;
@@ -101,9 +429,31 @@ size_t io_stream_read(io_stream_t* stream, char* buffer, size_t length, int exac
 		return io_stream_read_exact(stream, buffer, length);
 	}
 
-	if (stream->info.status.read_timeout ||
+	// Buffered bytes are served even after the stream ended
+	if (stream->ahead.length > 0)
+	{
+		return io_stream_ahead_read(stream, buffer, length);
+	}
+
+	if (!io_stream_read_ready(stream))
+	{
+		return 0;
+	}
+
+	return stream->filters.head->on_read(stream->filters.head, buffer, length);
+}
+
+size_t io_stream_write(io_stream_t* stream, const char* buffer, size_t length)
+{
+	int error;
+
+	if (length == 0)
+	{
+		return length;
+	}
+
+	if (stream->info.status.write_timeout ||
 		stream->info.status.error ||
-		stream->info.status.eof ||
 		stream->info.status.closed ||
 		stream->info.status.peer_closed ||
 		stream->info.status.shutdown)
@@ -125,40 +475,41 @@ size_t io_stream_read(io_stream_t* stream, char* buffer, size_t length, int exac
 		return 0;
 	}
 
-	if (stream->unread.length > 0)
+	if (stream->cork.enabled)
 	{
-		if (stream->unread.length <= length)
-		{
-			done = stream->unread.length;
-			memcpy(buffer, stream->unread.buffer + stream->unread.offset,
-				stream->unread.length);
-			io_free(stream->unread.buffer);
-			stream->unread.length = 0;
-		}
-		else
+		return io_stream_cork_write(stream, buffer, length);
+	}
+
+	return stream->filters.head->on_write(stream->filters.head, buffer, length);
+}
+
+size_t io_stream_readv(io_stream_t* stream, const io_iovec_t* vectors, size_t count)
+{
+	size_t done = 0;
+	size_t i;
+
+	if (stream->ahead.length > 0)
+	{
+		for (i = 0; i < count && stream->ahead.length > 0; ++i)
 		{
-			done = length;
-			memcpy(buffer, stream->unread.buffer + stream->unread.offset,
-				length);
-			stream->unread.offset += length;
-			stream->unread.length -= length;
+			done += io_stream_ahead_read(stream, vectors[i].buffer, vectors[i].length);
 		}
 
 		return done;
 	}
 
-	return stream->filters.head->on_read(stream->filters.head, buffer, length);
+	if (!io_stream_read_ready(stream))
+	{
+		return 0;
+	}
+
+	return stream->filters.head->on_readv(stream->filters.head, vectors, count);
 }
 
-size_t io_stream_write(io_stream_t* stream, const char* buffer, size_t length)
+size_t io_stream_writev(io_stream_t* stream, const io_iovec_t* vectors, size_t count)
 {
 	int error;
 
-	if (length == 0)
-	{
-		return length;
-	}
-
 	if (stream->info.status.write_timeout ||
 		stream->info.status.error ||
 		stream->info.status.closed ||
@@ -182,7 +533,163 @@ size_t io_stream_write(io_stream_t* stream, const char* buffer, size_t length)
 		return 0;
 	}
 
-	return stream->filters.head->on_write(stream->filters.head, buffer, length);
+	if (stream->cork.length > 0 && io_stream_cork_flush(stream) != 0)
+	{
+		return 0;
+	}
+
+	return stream->filters.head->on_writev(stream->filters.head, vectors, count);
+}
+
+int io_stream_set_cork(io_stream_t* stream, int enabled)
+{
+    stream->cork.enabled = enabled ? 1 : 0;
+
+    return enabled ? 0 : io_stream_flush(stream);
+}
+
+int io_stream_flush(io_stream_t* stream)
+{
+    if (stream->cork.length == 0)
+    {
+        return 0;
+    }
+
+    return io_stream_cork_flush(stream);
+}
+
+size_t io_stream_peek(io_stream_t* stream, io_iovec_t* vectors, size_t count)
+{
+    size_t n = 0;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // Other streams read once into the buffer when it is empty
+    if (stream->ahead.length == 0 && stream->info.type != IO_STREAM_MEMORY)
+    {
+        io_stream_ahead_fill(stream, IO_STREAM_AHEAD_SIZE);
+    }
+
+    if (stream->ahead.length > 0)
+    {
+        vectors[0].buffer = stream->ahead.buffer + stream->ahead.offset;
+        vectors[0].length = stream->ahead.length;
+        n = 1;
+    }
+
+    if (stream->info.type == IO_STREAM_MEMORY)
+    {
+        n += io_stream_memory_peek(stream, vectors + n, count - n);
+    }
+
+    return n;
+}
+
+size_t io_stream_consume(io_stream_t* stream, size_t length)
+{
+    size_t done = length < stream->ahead.length ? length : stream->ahead.length;
+
+    io_stream_ahead_drop(stream, done);
+
+    if (stream->info.type == IO_STREAM_MEMORY)
+    {
+        done += io_stream_memory_consume(stream, length - done);
+    }
+
+    return done;
+}
+
+int io_stream_read_until(io_stream_t* stream, const char* delimiter, size_t delimiter_length,
+                         char* buffer, size_t length, size_t* transferred)
+{
+    const char* found;
+    size_t scanned = 0;
+    size_t n;
+
+    *transferred = 0;
+
+    if (delimiter_length == 0 || delimiter_length > length)
+    {
+        return EINVAL;
+    }
+
+    do
+    {
+        found = io_stream_search(stream->ahead.buffer + stream->ahead.offset + scanned,
+                                 stream->ahead.length - scanned, delimiter, delimiter_length);
+        if (found != 0)
+        {
+            n = found - (stream->ahead.buffer + stream->ahead.offset) + delimiter_length;
+            if (n > length)
+            {
+                return ENOBUFS;
+            }
+
+            *transferred = io_stream_ahead_read(stream, buffer, n);
+            return 0;
+        }
+
+        if (stream->ahead.length >= length)
+        {
+            // Not within length bytes, they stay buffered
+            return ENOBUFS;
+        }
+
+        // A delimiter may start in the last bytes seen
+        if (stream->ahead.length >= delimiter_length)
+        {
+            scanned = stream->ahead.length - delimiter_length + 1;
+        }
+    }
+    while (io_stream_ahead_fill(stream, length - stream->ahead.length) > 0);
+
+    if (stream->info.status.error)
+    {
+        return stream->info.status.error;
+    }
+
+    return stream->info.status.read_timeout ? ETIMEDOUT : ENODATA;
+}
+
+int io_stream_splice(io_stream_t* from, io_stream_t* to, size_t length, size_t* moved)
+{
+    size_t n = 0;
+
+    // Chunks move raw, filters would never see them
+    if (from->info.type != IO_STREAM_MEMORY || to->info.type != IO_STREAM_MEMORY ||
+        !io_stream_unfiltered(from) || !io_stream_unfiltered(to))
+    {
+        if (moved)
+            *moved = 0;
+
+        return EINVAL;
+    }
+
+    if (io_stream_flush(to) != 0)
+    {
+        if (moved)
+            *moved = 0;
+
+        return to->info.status.error;
+    }
+
+    // Buffered bytes go first, as a copy
+    if (from->ahead.length > 0)
+    {
+        n = from->ahead.length < length ? from->ahead.length : length;
+        n = to->operations.on_write(&to->operations, from->ahead.buffer + from->ahead.offset, n);
+        io_stream_ahead_drop(from, n);
+    }
+
+    n += io_stream_memory_splice(from, to, length - n);
+
+    if (moved)
+        *moved = n;
+
+    return to->info.status.error;
 }
 
 size_t io_stream_unread(io_stream_t* stream, const char* buffer, size_t length)
@@ -190,16 +697,23 @@ size_t io_stream_unread(io_stream_t* stream, const char* buffer, size_t length)
     if (length == 0)
         return length;
 
-    if (stream->unread.length > 0)
-        io_free(stream->unread.buffer);
+    // Given back bytes go in front of the buffered ones
+    if (stream->ahead.offset < length)
+    {
+        if (io_stream_ahead_reserve(stream, stream->ahead.length + length) != 0)
+            return 0;
 
-    stream->unread.buffer = (char*)io_malloc(length);
-    stream->unread.length = length;
-    stream->unread.offset = 0;
+        memmove(stream->ahead.buffer + length, stream->ahead.buffer + stream->ahead.offset,
+                stream->ahead.length);
+        stream->ahead.offset = length;
+    }
 
-    memcpy(stream->unread.buffer, buffer, length);
+    stream->ahead.offset -= length;
+    stream->ahead.length += length;
 
-    return length;    
+    memcpy(stream->ahead.buffer + stream->ahead.offset, buffer, length);
+
+    return length;
 }
 
 size_t io_filter_on_read(io_filter_t* filter, char* buffer, size_t length)
@@ -217,12 +731,69 @@ void io_filter_on_status(io_filter_t* filter)
     filter->next->on_status(filter->next);
 }
 
+/*
+ * Filters replacing on_read see vectors one at a time, a read fills the
+ * first vector which is not empty like a plain read would
+ */
+size_t io_filter_on_readv(io_filter_t* filter, const io_iovec_t* vectors, size_t count)
+{
+    size_t i;
+
+    if (filter->on_read == io_filter_on_read)
+    {
+        return filter->next->on_readv(filter->next, vectors, count);
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        if (vectors[i].length > 0)
+        {
+            return filter->on_read(filter, vectors[i].buffer, vectors[i].length);
+        }
+    }
+
+    return 0;
+}
+
+// Filters replacing on_write see vectors one at a time
+size_t io_filter_on_writev(io_filter_t* filter, const io_iovec_t* vectors, size_t count)
+{
+    size_t done = 0;
+    size_t n;
+    size_t i;
+
+    if (filter->on_write == io_filter_on_write)
+    {
+        return filter->next->on_writev(filter->next, vectors, count);
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        if (vectors[i].length == 0)
+        {
+            continue;
+        }
+
+        n = filter->on_write(filter, vectors[i].buffer, vectors[i].length);
+        done += n;
+
+        if (n < vectors[i].length)
+        {
+            break;
+        }
+    }
+
+    return done;
+}
+
 void io_filter_attach(io_filter_t* filter, io_stream_t* stream)
 {
     filter->stream = stream;
     filter->on_read = io_filter_on_read;
     filter->on_write = io_filter_on_write;
     filter->on_status = io_filter_on_status;
+    filter->on_readv = io_filter_on_readv;
+    filter->on_writev = io_filter_on_writev;
 
     LIST_PUSH_HEAD((&stream->filters), filter);
 }
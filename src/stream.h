@@ -30,9 +30,18 @@ extern "C" {
 #include "io.h"
 #include "loop.h"
 #include "list.h"
+#include "memory.h"
 
+/*
+ * Memory streams keep a chain of chunks, each a view into a block of
+ * bucket_size bytes. Blocks are refcounted, so bytes move between
+ * streams by relinking chunks and a partially moved chunk shares its block
+ */
 typedef struct io_memory_chunk_t {
     LIST_NODE_OF(io_memory_chunk_t);
+    struct io_memory_block_t* block;
+    size_t offset;          // readable bytes are block data [offset, offset + length)
+    size_t length;
 } io_memory_chunk_t;
 
 typedef struct io_stream_t {
@@ -45,6 +54,9 @@ typedef struct io_stream_t {
 #elif PLATFORM_LINUX
         void(*processor)(struct io_stream_t* stream, int events);
         struct epoll_event e;
+        unsigned readable : 1;
+        unsigned writable : 1;
+        unsigned nowait_unsupported : 1;
 #else
 #   error Not implemented
 #endif
@@ -72,9 +84,7 @@ typedef struct io_stream_t {
         struct {
             LIST_OF(io_memory_chunk_t);
             uint64_t bucket_size;
-            uint64_t length;
-            uint64_t read_offset;
-            uint64_t write_offset;
+            uint64_t length;        // readable bytes in all chunks
         } memory;
     } impl;
 
@@ -82,7 +92,21 @@ typedef struct io_stream_t {
         char* buffer;
         size_t offset;
         size_t length;
-    } unread;
+        size_t size;
+    } ahead;                // read-ahead and given back bytes, see io_stream_peek
+
+    struct {
+        char* buffer;       // from the loop pool while bytes are pending
+        size_t length;
+        unsigned enabled : 1;
+    } cork;                 // see io_stream_set_cork
+
+#if IO_STREAM_LATENCY
+    struct {
+        histogram_t read;
+        histogram_t write;
+    } latency;              // see io_stream_latency
+#endif
 } io_stream_t;
 
 static size_t io_stream_read_exact(io_stream_t* stream, char* buffer, size_t length)
@@ -102,9 +126,76 @@ static size_t io_stream_read_exact(io_stream_t* stream, char* buffer, size_t len
     return offset;
 }
 
+static void io_stream_ahead_drop(io_stream_t* stream, size_t length)
+{
+    stream->ahead.offset += length;
+    stream->ahead.length -= length;
+
+    if (stream->ahead.length == 0)
+    {
+        stream->ahead.offset = 0;
+    }
+}
+
+// Writes buffered bytes ahead of a direct pipe, 0 when the write failed
+static int io_stream_ahead_flush(io_stream_t* from, io_stream_t* to, size_t* transferred)
+{
+    size_t length = from->ahead.length;
+    size_t n;
+
+    if (length == 0)
+    {
+        return 1;
+    }
+
+    // Bypasses a cork, the kernel writes next
+    n = to->filters.head->on_write(to->filters.head, from->ahead.buffer + from->ahead.offset, length);
+    *transferred += n;
+
+    io_stream_ahead_drop(from, length);
+
+    return n == length;
+}
+
+// Records an operation in the stream and loop latency histograms
+static void io_stream_latency_record(io_stream_t* stream, int write, uint64_t nanoseconds)
+{
+#if IO_STREAM_LATENCY
+    if (write)
+    {
+        histogram_record(&stream->latency.write, nanoseconds);
+        histogram_record(&stream->loop->latency.write, nanoseconds);
+    }
+    else
+    {
+        histogram_record(&stream->latency.read, nanoseconds);
+        histogram_record(&stream->loop->latency.read, nanoseconds);
+    }
+#endif
+}
+
 void io_stream_init(io_stream_t* stream);
 int io_stream_attach(io_stream_t* stream);
 
+// Default vector handlers, split into on_read/on_write when those are replaced
+size_t io_filter_on_readv(io_filter_t* filter, const io_iovec_t* vectors, size_t count);
+size_t io_filter_on_writev(io_filter_t* filter, const io_iovec_t* vectors, size_t count);
+
+// Memory streams, see stream-memory.c
+void io_stream_memory_init(io_stream_t* stream);
+void io_stream_memory_cleanup(io_stream_t* stream);
+size_t io_stream_memory_peek(io_stream_t* stream, io_iovec_t* vectors, size_t count);
+size_t io_stream_memory_consume(io_stream_t* stream, size_t length);
+size_t io_stream_memory_splice(io_stream_t* from, io_stream_t* to, size_t length);
+
+/*
+ * Moves data between streams without filters inside the kernel, adds the
+ * bytes moved to transferred. ENOTSUP when the pair is not supported,
+ * before anything was moved
+ */
+int io_stream_pipe_direct(io_stream_t* from, io_stream_t* to, size_t chunk_size,
+                          size_t* transferred);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
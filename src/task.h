@@ -28,7 +28,9 @@ extern "C" {
 
 #include "loop.h"
 
-int task_create(task_t** task, io_loop_fn entry, void* arg);
+#define IO_TASK_MIN_STACK_SIZE (16 * 1024)
+
+int task_create(task_t** task, io_loop_t* loop, io_loop_fn entry, void* arg, size_t stack_size); // 0 uses loop default
 int task_delete(task_t* task);
 int task_yield(task_t* current, void* value); // may return is_cancelled
 int task_exec(task_t* task, io_loop_t* loop, void** yield);
@@ -37,6 +39,11 @@ int task_next(task_t* task, io_loop_t* loop, void** yield);
 int task_suspend(task_t* current);
 int task_resume(task_t* task);
 
+void task_cache_init(task_cache_t* cache);
+void task_cache_cleanup(task_cache_t* cache);
+void task_cache_trim(task_cache_t* cache, uint64_t now);
+int task_cache_set_stack_size(task_cache_t* cache, size_t stack_size);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
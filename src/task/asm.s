@@ -40,6 +40,14 @@
 #define GET getmcontext
 #endif
 
+#if defined(__linux__) && defined(__x86_64__) && !defined(IO_USE_UCONTEXT)
+#define NEEDAMD64SWITCH 1
+#endif
+
+#if defined(__linux__) && defined(__aarch64__) && !defined(IO_USE_UCONTEXT)
+#define NEEDARM64SWITCH 1
+#endif
+
 #ifdef NEEDX86CONTEXT
 .globl SET
 SET:
@@ -323,4 +331,90 @@ SET:
 
 	j	$8
 	nop
+#endif
+
+/*
+ * fastcontext_swap(fastcontext_t* from, fastcontext_t* to)
+ *
+ * Saves callee-saved registers on the current stack, stores stack pointer
+ * into from->sp and restores the same frame from to->sp. Signal mask is
+ * not touched, see fastcontext_make in task/context.h for initial frame.
+ */
+
+#ifdef NEEDAMD64SWITCH
+.text
+.globl fastcontext_swap
+.type fastcontext_swap, @function
+.align 16
+fastcontext_swap:
+	pushq	%rbp
+	pushq	%rbx
+	pushq	%r12
+	pushq	%r13
+	pushq	%r14
+	pushq	%r15
+	subq	$8, %rsp
+	stmxcsr	(%rsp)		/* sse control/status */
+	fnstcw	4(%rsp)		/* x87 control word */
+
+	movq	%rsp, (%rdi)
+	movq	(%rsi), %rsp
+
+	ldmxcsr	(%rsp)
+	fldcw	4(%rsp)
+	addq	$8, %rsp
+	popq	%r15
+	popq	%r14
+	popq	%r13
+	popq	%r12
+	popq	%rbx
+	popq	%rbp
+	ret
+.size fastcontext_swap, .-fastcontext_swap
+#endif
+
+#ifdef NEEDARM64SWITCH
+.text
+.globl fastcontext_swap
+.type fastcontext_swap, %function
+.align 4
+fastcontext_swap:
+	sub	sp, sp, #176
+	stp	x19, x20, [sp, #0]
+	stp	x21, x22, [sp, #16]
+	stp	x23, x24, [sp, #32]
+	stp	x25, x26, [sp, #48]
+	stp	x27, x28, [sp, #64]
+	stp	x29, x30, [sp, #80]
+	stp	d8, d9, [sp, #96]
+	stp	d10, d11, [sp, #112]
+	stp	d12, d13, [sp, #128]
+	stp	d14, d15, [sp, #144]
+	mrs	x9, fpcr
+	str	x9, [sp, #160]
+
+	mov	x9, sp
+	str	x9, [x0]
+	ldr	x9, [x1]
+	mov	sp, x9
+
+	ldr	x9, [sp, #160]
+	msr	fpcr, x9
+	ldp	d14, d15, [sp, #144]
+	ldp	d12, d13, [sp, #128]
+	ldp	d10, d11, [sp, #112]
+	ldp	d8, d9, [sp, #96]
+	ldp	x29, x30, [sp, #80]
+	ldp	x27, x28, [sp, #64]
+	ldp	x25, x26, [sp, #48]
+	ldp	x23, x24, [sp, #32]
+	ldp	x21, x22, [sp, #16]
+	ldp	x19, x20, [sp, #0]
+	add	sp, sp, #176
+	ret
+.size fastcontext_swap, .-fastcontext_swap
+#endif
+
+#if defined(__linux__) && defined(__ELF__)
+.section .note.GNU-stack, "", %progbits
 #endif
\ No newline at end of file
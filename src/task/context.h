@@ -130,4 +130,26 @@ void setmcontext(const mcontext_t*);
 #   include "win-ucontext.h"
 #endif
 
+/*
+ * Register-only context switch (task/asm.s), keeps signal mask
+ * untouched and avoids sigprocmask syscall on every switch
+ */
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__)) && \
+    !defined(IO_USE_UCONTEXT)
+#   define USE_FASTCONTEXT 1
+#else
+#   define USE_FASTCONTEXT 0
+#endif
+
+#if USE_FASTCONTEXT
+
+typedef struct fastcontext_t {
+    void* sp;
+} fastcontext_t;
+
+extern void fastcontext_swap(fastcontext_t* from, fastcontext_t* to);
+
+#endif
+
 #endif // TASK_CONTEXT_H_INCLUDED
\ No newline at end of file
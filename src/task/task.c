@@ -28,6 +28,10 @@
 
 #include <malloc.h>
 
+#if !defined(NDEBUG) && PLATFORM_WINDOWS == 0
+#   define TASK_STACK_USAGE 1
+#endif
+
 #if defined (_WIN64)
 __declspec(noinline) void __stdcall fix_and_swapcontext(
 	ucontext_t* from,
@@ -65,9 +69,50 @@ static void task_entry_point()
     task->entry(task->loop, task->arg);
     task->is_done = 1;
     task->loop->prev = task;
+#if USE_FASTCONTEXT
+    fastcontext_swap(&task->context, &task->parent->context);
+#else
     setcontext(&task->parent->context);
+#endif
 }
 
+#if USE_FASTCONTEXT
+
+/*
+ * Lays out initial frame on top of the stack so first fastcontext_swap
+ * to the task pops zeroed callee-saved registers and returns into entry
+ */
+static void fastcontext_make(
+    fastcontext_t* context,
+    void* stack,
+    size_t stack_size,
+    void (*entry)())
+{
+    uintptr_t* top = (uintptr_t*)
+        (((uintptr_t)stack + stack_size) & ~(uintptr_t)15);
+
+#if defined(__x86_64__)
+    uintptr_t* sp = top - 9;
+
+    memset(sp, 0, 9 * sizeof(uintptr_t));
+
+    top[-1] = 0;                    /* entry return address */
+    top[-2] = (uintptr_t)entry;     /* fastcontext_swap return address */
+    sp[0] = 0x037F00001F80ull;      /* fpu control word, mxcsr */
+#elif defined(__aarch64__)
+    uintptr_t* sp = top - 22;
+
+    memset(sp, 0, 22 * sizeof(uintptr_t));
+
+    sp[11] = (uintptr_t)entry;      /* x30 */
+    __asm__ volatile("mrs %0, fpcr" : "=r"(sp[20]));
+#endif
+
+    context->sp = sp;
+}
+
+#endif
+
 #if PLATFORM_WINDOWS && (COMPILER_MSVC || COMPILER_INTEL)
 #pragma optimize("", off)
 #endif
@@ -84,9 +129,15 @@ void task_swapcontext(struct task_t* current, struct task_t* other)
     DWORD win_error = GetLastError();
 #endif
 
+    counter_increment(&loop->performance.task_swapcontext, 0);
+
     loop->prev = current;
     loop->current = other;
+#if USE_FASTCONTEXT
+    fastcontext_swap(&current->context, &other->context);
+#else
     swapcontext(&current->context, &other->context);
+#endif
     loop->current = current;
 
     if (loop->prev != 0 &&
@@ -131,22 +182,32 @@ static DWORD task_get_page_size()
     return si.dwPageSize;
 }
 
-static void* task_create_stack(size_t size)
+static size_t task_page_size()
 {
     if (page_size == 0)
     {
         page_size = task_get_page_size();
     }
 
+    return page_size;
+}
+
+static void* task_create_stack(size_t size)
+{
+    DWORD protect;
+
 	// auto grow doesn't work as expected, commiting whole stack 
-	void* vp = VirtualAlloc(0, size, MEM_COMMIT, PAGE_READWRITE);
+	char* vp = (char*)VirtualAlloc(0, size + task_page_size(), MEM_COMMIT, PAGE_READWRITE);
 	if (!vp)
 	{
 		errno = ENOMEM;
 		return 0;
 	}
 
-	return vp;
+    // guard page below the stack
+    VirtualProtect(vp, page_size, PAGE_NOACCESS, &protect);
+
+	return vp + page_size;
 
 //    void* vp = VirtualAlloc(0, size, MEM_RESERVE, PAGE_READWRITE);
 //    if (!vp)
@@ -181,25 +242,35 @@ static void* task_create_stack(size_t size)
 
 static void task_delete_stack(void* stack, size_t size)
 {
-    VirtualFree(stack, 0, MEM_RELEASE);
+    VirtualFree((char*)stack - page_size, 0, MEM_RELEASE);
+}
+
+static void task_trim_stack(void* stack, size_t size)
+{
+    VirtualAlloc(stack, size, MEM_RESET, PAGE_READWRITE);
 }
 
 #else
 
 #include <sys/mman.h>
 
-static int page_size = 0;
+static size_t page_size = 0;
 
-static void* task_create_stack(size_t size)
+static size_t task_page_size()
 {
     if (page_size == 0)
     {
         page_size = getpagesize();
     }
 
-    void* vp = mmap(
+    return page_size;
+}
+
+static void* task_create_stack(size_t size)
+{
+    char* vp = mmap(
         0,                      // void *addr,
-        size,                   // size_t length,
+        size + task_page_size(),// size_t length,
         PROT_READ | PROT_WRITE, // int prot,
         MAP_ANONYMOUS |         // int flags,
         MAP_NORESERVE |
@@ -209,88 +280,394 @@ static void* task_create_stack(size_t size)
         -1,                     // int fd,
         0                       // off_t offset
     );
-    if (!vp)
+    if (vp == MAP_FAILED)
     {
         return 0;
     }
+
+    // guard page below the stack, overflow faults instead of
+    // corrupting neighbour mapping
+    if (mprotect(vp, page_size, PROT_NONE))
+    {
+        munmap(vp, size + page_size);
+        return 0;
+    }
+
+    return vp + page_size;
 }
 
 static void task_delete_stack(void* stack, size_t size)
 {
-    munmap(stack, size);
+    munmap((char*)stack - page_size, size + page_size);
+}
+
+static void task_trim_stack(void* stack, size_t size)
+{
+    // Pages are zero filled on next touch
+    madvise(stack, size, MADV_DONTNEED);
+}
+
+#if TASK_STACK_USAGE
+/*
+ * Stack grows down, lowest resident page is the deepest one touched
+ */
+static size_t task_stack_usage(void* stack, size_t size)
+{
+    unsigned char pages[256];
+    size_t count = size / page_size;
+    size_t offset, chunk, i;
+
+    for (offset = 0; offset < count; offset += chunk)
+    {
+        chunk = count - offset < sizeof (pages) ? count - offset : sizeof (pages);
+
+        if (mincore((char*)stack + offset * page_size, chunk * page_size, pages))
+        {
+            return 0;
+        }
+
+        for (i = 0; i < chunk; ++i)
+        {
+            if (pages[i] & 1)
+            {
+                return size - (offset + i) * page_size;
+            }
+        }
+    }
+
+    return 0;
 }
+#endif
+
+#endif
+
+static size_t task_round_stack_size(size_t size)
+{
+    size_t page = task_page_size();
+
+    if (size < IO_TASK_MIN_STACK_SIZE)
+    {
+        size = IO_TASK_MIN_STACK_SIZE;
+    }
+
+    return (size + page - 1) & ~(page - 1);
+}
+
+static void task_make_context(task_t* task)
+{
+#if PLATFORM_WINDOWS && (COMPILER_MSVC || COMPILER_INTEL)
+
+    task->context.uc.ContextFlags = CONTEXT_ALL;
+
+    getcontext(&task->context);
+
+    task->context.stack = task->stack;
+    task->context.stack_size = task->stack_size;
+
+    makecontext(&task->context, (void(*)())task_entry_point, 1, task);
+
+#elif USE_FASTCONTEXT
+
+    fastcontext_make(
+        &task->context,
+        task->stack,
+        task->stack_size,
+        (void(*)())task_entry_point);
+
+#else
+
+    getcontext(&task->context);
+
+    task->context.uc_stack.ss_sp = task->stack;
+    task->context.uc_stack.ss_size = task->stack_size;
+    task->context.uc_stack.ss_flags = 0;
+    task->context.uc_link = 0;
+
+    makecontext(&task->context, (void(*)())task_entry_point, 1, task);
 
 #endif
+}
+
+static task_t* task_cache_pop(task_cache_t* cache)
+{
+    task_t* task = cache->head;
+
+    if (task == 0)
+    {
+        return 0;
+    }
+
+    cache->head = task->parent;
+    cache->count--;
+
+    if (cache->count < cache->low)
+    {
+        cache->low = cache->count;
+    }
+
+    return task;
+}
+
+/*
+ * Pops a cached task, stacks cached before default size was changed
+ * are released
+ */
+static task_t* task_cache_take(io_loop_t* loop, size_t stack_size)
+{
+    task_t* task = task_cache_pop(&loop->task_cache);
+
+    if (task != 0 && task->stack_size != stack_size)
+    {
+        task_delete_stack(task->stack, task->stack_size);
+        io_loop_free(loop, task);
+        task = 0;
+    }
+
+    return task;
+}
+
+static int task_cache_push(task_cache_t* cache, task_t* task)
+{
+    if (cache->count >= cache->limit ||
+        task->stack_size != cache->stack_size)
+    {
+        return 0;
+    }
+
+    task->parent = cache->head;
+    cache->head = task;
+    cache->count++;
+
+    return 1;
+}
+
+static void task_reset(task_t* task, io_loop_fn entry, void* arg)
+{
+    task->node.next = 0;
+    task->loop = 0;
+    task->entry = entry;
+    task->arg = arg;
+    task->is_done = 0;
+    task->is_post = 0;
+    task->is_trimmed = 0;
+    task->is_stealable = 0;
+    task->parent = 0;
+    task->inherit_error_state = 0;
+    task->post_time = 0;
+}
+
+/*
+ * Stacks of tasks posted from other threads are attached on the loop
+ * executing them, so stacks return to the same cache they came from
+ */
+static int task_attach_stack(task_t* task, io_loop_t* loop)
+{
+    task_t* cached = 0;
+
+    // Default of the executing loop, posts from other threads leave it open
+    if (task->stack_size == 0)
+    {
+        task->stack_size = loop->task_cache.stack_size;
+    }
+
+    // only default sized stacks are cached
+    if (task->stack_size == loop->task_cache.stack_size)
+    {
+        cached = task_cache_take(loop, task->stack_size);
+    }
+
+    if (cached != 0)
+    {
+        task->stack = cached->stack;
+        io_loop_free(loop, cached);
+    }
+    else
+    {
+        task->stack = task_create_stack(task->stack_size);
+        if (task->stack == 0)
+        {
+            return ENOMEM;
+        }
+    }
+
+    task_make_context(task);
+    return 0;
+}
 
 /*
  * Internal API
  */
 
-int task_create(struct task_t** task, io_loop_fn entry, void* arg)
+void task_cache_init(task_cache_t* cache)
 {
-    uintptr_t stack_size = task_get_default_stack_size();
+    cache->head = 0;
+    cache->count = 0;
+    cache->limit = IO_TASK_CACHE_LIMIT;
+    cache->low = 0;
+    cache->trim_interval = IO_TASK_CACHE_TRIM_INTERVAL;
+    cache->trim_time = 0;
+    cache->stack_size = task_get_default_stack_size();
+}
 
-    *task = (task_t*)io_calloc(1, sizeof(**task));
-    if (*task == 0)
+void task_cache_cleanup(task_cache_t* cache)
+{
+    task_t* task = task_cache_pop(cache);
+
+    while (task != 0)
     {
-        errno = ENOMEM;
-        return errno;
+        task_delete_stack(task->stack, task->stack_size);
+        io_free(task);
+
+        task = task_cache_pop(cache);
     }
+}
+
+void task_cache_trim(task_cache_t* cache, uint64_t now)
+{
+    task_t* task;
+    size_t hot;
 
-    (*task)->stack = task_create_stack(stack_size);
-    if ((*task)->stack == 0)
+    if (cache->trim_interval == 0 || now < cache->trim_time)
     {
-        io_free(*task);
+        return;
+    }
 
-        errno = ENOMEM;
-        return errno;
+    /*
+     * release over the limit, it may have been lowered
+     */
+
+    while (cache->count > cache->limit)
+    {
+        task = task_cache_pop(cache);
+        task_delete_stack(task->stack, task->stack_size);
+        io_free(task);
     }
 
-    (*task)->stack_size = stack_size;
-    (*task)->entry = entry;
-    (*task)->arg = arg;
-    (*task)->is_done = 0;
-    (*task)->is_post = 0;
-    (*task)->parent = 0;
-    (*task)->inherit_error_state = 0;
+    /*
+     * stacks which stayed in the cache for the whole interval are
+     * at the tail of the list, return their pages to the OS
+     */
 
-#if PLATFORM_WINDOWS && (COMPILER_MSVC || COMPILER_INTEL)
+    hot = cache->count - (cache->low < cache->count ? cache->low : cache->count);
+    for (task = cache->head; task != 0; task = task->parent)
+    {
+        if (hot > 0)
+        {
+            hot--;
+            continue;
+        }
+
+        if (task->is_trimmed == 0)
+        {
+            task_trim_stack(task->stack, task->stack_size);
+            task->is_trimmed = 1;
+        }
+    }
 
-    (*task)->context.uc.ContextFlags = CONTEXT_ALL;
+    cache->low = cache->count;
+    cache->trim_time = now + cache->trim_interval;
+}
 
-    getcontext(&(*task)->context);
+/*
+ * Cached stacks of the previous size are released as they are taken, see
+ * task_cache_take. Called on the loop thread
+ */
+int task_cache_set_stack_size(task_cache_t* cache, size_t stack_size)
+{
+    if (stack_size == 0)
+    {
+        return EINVAL;
+    }
 
-    (*task)->context.stack = (*task)->stack;
-    (*task)->context.stack_size = (*task)->stack_size;
+    cache->stack_size = task_round_stack_size(stack_size);
 
-    makecontext(&(*task)->context, (void(*)())task_entry_point, 1, *task);
+    return 0;
+}
 
-#else
+int task_create(
+    struct task_t** task,
+    io_loop_t* loop,
+    io_loop_fn entry,
+    void* arg,
+    size_t stack_size)
+{
+    // Counters of other loops are not ours to write
+    io_loop_t* own = (loop != 0 && loop == io_loop_current()) ? loop : 0;
 
-    getcontext(&(*task)->context);
+    if (stack_size == 0)
+    {
+        // Unknown to other threads, attached with the executing loop's default
+        stack_size = own != 0 ? own->task_cache.stack_size : 0;
+    }
+    else
+    {
+        stack_size = task_round_stack_size(stack_size);
+    }
 
-    (*task)->context.uc_stack.ss_sp = (*task)->stack;
-    (*task)->context.uc_stack.ss_size = (*task)->stack_size;
-    (*task)->context.uc_stack.ss_flags = 0;
-    (*task)->context.uc_link = 0;
+    /*
+     * reuse a cached task with stack when posting to own loop,
+     * otherwise stack is attached by the executing loop, see task_post
+     */
 
-    makecontext(&(*task)->context, (void(*)())task_entry_point, 1, *task);
+    if (own != 0 && stack_size == own->task_cache.stack_size)
+    {
+        *task = task_cache_take(loop, stack_size);
+        if (*task != 0)
+        {
+            task_reset(*task, entry, arg);
+            task_make_context(*task);
+            return 0;
+        }
+    }
 
-#endif
+    *task = (task_t*)io_loop_calloc(own, 1, sizeof(**task));
+    if (*task == 0)
+    {
+        errno = ENOMEM;
+        return errno;
+    }
+
+    task_reset(*task, entry, arg);
+    (*task)->stack_size = stack_size;
 
     return 0;
 }
 
 int task_delete(struct task_t* task)
 {
+    io_loop_t* own;
+
     if (task->loop != 0 && task->loop->current == task)
     {
         /* Cannot delete self task */
         return EDEADLOCK;
     }
 
-    task_delete_stack(task->stack, task->stack_size);
-    io_free(task);
+#if TASK_STACK_USAGE
+    if (task->stack != 0 && task->loop != 0)
+    {
+        size_t usage = task_stack_usage(task->stack, task->stack_size);
+        if (usage > task->loop->stack_high_water)
+        {
+            task->loop->stack_high_water = usage;
+        }
+    }
+#endif
+
+    own = (task->loop != 0 && task->loop == io_loop_current()) ? task->loop : 0;
+
+    if (task->stack != 0 && own != 0 &&
+        task_cache_push(&own->task_cache, task))
+    {
+        return 0;
+    }
+
+    if (task->stack != 0)
+    {
+        task_delete_stack(task->stack, task->stack_size);
+    }
+
+    io_loop_free(own, task);
 
     return 0;
 }
@@ -319,6 +696,11 @@ int task_exec(task_t* task, io_loop_t* loop, void** yield)
         return EALREADY;
     }
 
+    if (task->stack == 0 && task_attach_stack(task, loop))
+    {
+        return ENOMEM;
+    }
+
     task->loop = loop;
     
     /*
@@ -361,6 +743,11 @@ int task_next(task_t* task, io_loop_t* loop, void** yield)
 
 int task_post(task_t* task, io_loop_t* loop)
 {
+    if (task->stack == 0 && task_attach_stack(task, loop))
+    {
+        return ENOMEM;
+    }
+
     task->loop = loop;
     task->parent = &loop->main;
     task->is_post = 1;
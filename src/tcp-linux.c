@@ -35,8 +35,10 @@
 #include "memory.h"
 #include "loop-linux.h"
 
+// Accepted sockets queued per listener by a single readiness event
+#define IO_TCP_ACCEPT_BATCH 64
+
 typedef struct io_tcp_accept_t {
-    io_stream_t* tcp;
     task_t* task;
     int error;
 } io_tcp_accept_t;
@@ -46,11 +48,15 @@ typedef struct io_tcp_listener_t {
     struct epoll_event e;
     io_loop_t* loop;
     io_tcp_accept_t* accept;
+    int pending[IO_TCP_ACCEPT_BATCH];
+    size_t pending_head;
+    size_t pending_count;
     int af;
     int fd;
     int error;
     unsigned closed : 1;
     unsigned shutdown : 1;
+    unsigned readable : 1;
 } io_tcp_listener_t;
 
 static int io_socket_non_block(int fd, int on)
@@ -115,95 +121,188 @@ static int io_tcp_keepalive(int fd, int enable, unsigned int delay)
     return 0;
 }
 
-static void io_tcp_listener_accept_try(io_tcp_listener_t* listener)
+static int io_tcp_accepted_options(int fd)
 {
-    struct sockaddr address;
-    socklen_t length = sizeof(address);
-    io_stream_t* tcp = listener->accept->tcp;
-    int error = 0;
+    int error = io_socket_recv_buffer_size(fd, 0);
 
-    tcp->fd = accept(listener->fd, &address, &length);
-    if (tcp->fd == -1)
+    if (!error)
     {
-        if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-        {
-            /* We have processed all incoming connections. */
-        }
-        else
-        {
-            error = errno;
-        }
+        error = io_socket_send_buffer_size(fd, 0);
     }
 
     if (!error)
     {
-        error = io_socket_non_block(tcp->fd, 1);
+        error = io_tcp_nodelay(fd, 1);
     }
 
-    if (!error)
+    return error;
+}
+
+/*
+ * Accepts until the backlog is empty or the queue is full. Sockets come out
+ * non-blocking, so there is no ioctl per connection
+ */
+static int io_tcp_listener_drain(io_tcp_listener_t* listener)
+{
+    size_t tail;
+    int fd;
+
+    while (listener->pending_count < IO_TCP_ACCEPT_BATCH)
     {
-        error = io_socket_recv_buffer_size(tcp->fd, 0);
+        fd = accept4(listener->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                /* We have processed all incoming connections. */
+                listener->readable = 0;
+                return 0;
+            }
+
+            if ((errno == EINTR) || (errno == ECONNABORTED))
+            {
+                continue;
+            }
+
+            return errno;
+        }
+
+        if (io_tcp_accepted_options(fd))
+        {
+            io_close(fd);
+            continue;
+        }
+
+        tail = (listener->pending_head + listener->pending_count) % IO_TCP_ACCEPT_BATCH;
+        listener->pending[tail] = fd;
+        listener->pending_count++;
     }
 
-    if (!error)
+    return 0;
+}
+
+static int io_tcp_listener_pop(io_tcp_listener_t* listener, io_stream_t** tcp)
+{
+    io_stream_t* stream;
+
+    stream = io_loop_calloc(listener->loop, 1, sizeof(*stream));
+    if (stream == 0)
     {
-        error = io_socket_send_buffer_size(tcp->fd, 0);
+        return ENOMEM;
     }
 
-    if (!error)
+    stream->info.type = IO_STREAM_TCP;
+    stream->fd = listener->pending[listener->pending_head];
+
+    listener->pending_head = (listener->pending_head + 1) % IO_TCP_ACCEPT_BATCH;
+    listener->pending_count--;
+
+    counter_increment(&listener->loop->performance.tcp_accept, 0);
+
+    io_stream_init(stream);
+    *tcp = stream;
+
+    return 0;
+}
+
+// Suspends until there is at least one queued connection
+static int io_tcp_listener_wait(io_tcp_listener_t* listener)
+{
+    io_tcp_accept_t accept;
+    int error;
+
+    while (listener->pending_count == 0)
     {
-        error = io_tcp_nodelay(tcp->fd, 1);
+        if (listener->readable)
+        {
+            error = io_tcp_listener_drain(listener);
+            if (error && listener->pending_count == 0)
+            {
+                return error;
+            }
+
+            continue;
+        }
+
+        accept.task = listener->loop->current;
+        accept.error = 0;
+        listener->accept = &accept;
+
+        task_suspend(accept.task);
+
+        listener->accept = 0;
+
+        if (accept.error)
+        {
+            return accept.error;
+        }
     }
 
-    listener->accept->error = error;
+    return 0;
 }
 
 static void io_tcp_listener_processor(io_tcp_listener_t* listener, int events)
 {
-    int error;
-    int wakeup = 1;
-    task_t* task = 0;
+    socklen_t length;
+    int error = 0;
 
     if (events == -1)
     {
-        listener->accept->error = ECANCELED;
+        error = ECANCELED;
     }
     else if (events & EPOLLERR)
     {
-        listener->accept->error = errno;
+        length = sizeof(error);
+        if (0 != getsockopt(listener->fd, SOL_SOCKET, SO_ERROR, &error, &length))
+        {
+            error = errno;
+        }
+
+        if (error == 0)
+        {
+            error = ECANCELED;
+        }
     }
     else if (events & EPOLLHUP)
     {
-        listener->accept->error = ECANCELED;
+        error = ECANCELED;
     }
-    else
+    else if ((events & EPOLLIN) || (events & EPOLLPRI))
     {
-        if ((events & EPOLLIN) || (events & EPOLLPRI))
-        {
-            io_tcp_listener_accept_try(listener);
-            wakeup = listener->accept->error == 0;
-        }
-        else
-        {
-            listener->accept->error = errno;
-        }
+        listener->readable = 1;
+    }
+
+    if (error)
+    {
+        // Edge-triggered, there will be no second notification
+        listener->error = error;
     }
 
-    if (wakeup)
+    if (listener->accept != 0)
     {
+        listener->accept->error = error;
         task_resume(listener->accept->task);
     }
 }
 
 static void io_tcp_connect_processor(io_stream_t* stream, int events)
 {
+    socklen_t length;
+    int error = 0;
+
     if (events == -1)
     {
         stream->info.status.shutdown = 1;
     }
     else if (events & EPOLLERR)
     {
-        stream->info.status.error = errno;
+        length = sizeof(error);
+        if (0 != getsockopt(stream->fd, SOL_SOCKET, SO_ERROR, &error, &length))
+        {
+            error = errno;
+        }
+
+        stream->info.status.error = error ? error : ECONNREFUSED;
     }
     else if (events & EPOLLHUP)
     {
@@ -217,6 +316,120 @@ static void io_tcp_connect_processor(io_stream_t* stream, int events)
     task_resume((task_t*)stream->platform.read_req);
 }
 
+#if IO_USE_URING
+
+static int io_tcp_accept_uring(io_tcp_listener_t* listener, io_stream_t** tcp)
+{
+    struct io_uring_sqe* sqe;
+    io_stream_t* stream;
+    int result;
+
+    sqe = io_uring_sqe_get(listener->loop);
+    if (sqe == 0)
+    {
+        return EAGAIN;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener->fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+
+    result = io_uring_sqe_wait(listener->loop, sqe, 0, 0);
+    if (result < 0)
+    {
+        return -result;
+    }
+
+    stream = io_loop_calloc(listener->loop, 1, sizeof(*stream));
+    if (stream == 0)
+    {
+        io_close(result);
+        return ENOMEM;
+    }
+
+    stream->info.type = IO_STREAM_TCP;
+    stream->fd = result;
+
+    counter_increment(&listener->loop->performance.tcp_accept, 0);
+
+    result = io_tcp_accepted_options(stream->fd);
+    if (result)
+    {
+        io_close(stream->fd);
+        io_loop_free(listener->loop, stream);
+        return result;
+    }
+
+    io_stream_init(stream);
+    *tcp = stream;
+
+    return 0;
+}
+
+static int io_tcp_connect_uring(io_loop_t* loop, io_stream_t* stream,
+    struct sockaddr* address, socklen_t length, uint64_t timeout)
+{
+    struct io_uring_sqe* sqe;
+    int timedout = 0;
+    int result;
+
+    sqe = io_uring_sqe_get(loop);
+    if (sqe == 0)
+    {
+        return EAGAIN;
+    }
+
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = stream->fd;
+    sqe->addr = (uint64_t)(uintptr_t)address;
+    sqe->off = length;
+
+    result = io_uring_sqe_wait(loop, sqe, timeout, &timedout);
+    if (result == 0)
+    {
+        return 0;
+    }
+
+    return timedout ? ETIMEDOUT : -result;
+}
+
+#endif // IO_USE_URING
+
+// Time a successful accept call waited for its connection
+static void io_tcp_accept_latency(io_tcp_listener_t* listener, uint64_t start)
+{
+#if IO_PERFORMANCE
+    histogram_record(&listener->loop->latency.accept,
+                     PERFORMANCE_NANOSECONDS(start, PERFORMANCE_MEASURE()));
+#endif
+}
+
+static int io_tcp_accept_status(io_tcp_listener_t* listener)
+{
+    if (listener->error)
+    {
+        return listener->error;
+    }
+
+    if (listener->closed)
+    {
+        return ECANCELED;
+    }
+
+    if (listener->shutdown)
+    {
+        return ECANCELED;
+    }
+
+    if (atomic_load64(&listener->loop->shutdown))
+    {
+        listener->shutdown = 1;
+        return ECANCELED;
+    }
+
+    return 0;
+}
+
 /*
  * Internal API
  */
@@ -226,11 +439,8 @@ int io_tcp_init()
     return 0;
 }
 
-/*
- * Public API
- */
-
-int io_tcp_listen(io_tcp_listener_t** listener, const char* ip, int port, int backlog)
+static int io_tcp_listen_options(io_tcp_listener_t** listener, const char* ip,
+                                 int port, int backlog, int reuseport)
 {
     struct sockaddr_in addr_in;
     struct sockaddr_in6 addr_in6;
@@ -285,23 +495,53 @@ int io_tcp_listen(io_tcp_listener_t** listener, const char* ip, int port, int ba
     error = io_socket_send_buffer_size((*listener)->fd, 0);
     error = io_tcp_nodelay((*listener)->fd, 1);
 
+    if (reuseport &&
+        0 != setsockopt((*listener)->fd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport)))
+    {
+        error = errno;
+        io_close((*listener)->fd);
+        io_free(*listener);
+        return error;
+    }
+
+#ifdef SO_INCOMING_CPU
+    /*
+     * Connections whose packets arrive on the loop's processor go to this
+     * listener, best effort as older kernels ignore it
+     */
+    if (reuseport && loop->cpu >= 0)
+    {
+        setsockopt((*listener)->fd, SOL_SOCKET, SO_INCOMING_CPU, &loop->cpu, sizeof(loop->cpu));
+    }
+#endif
+
     if (0 != bind((*listener)->fd, address, length))
     {
+        error = errno;
+        io_close((*listener)->fd);
         io_free(*listener);
-        return errno;
+        return error;
     }
 
     if (0 != listen((*listener)->fd, backlog))
     {
+        error = errno;
+        io_close((*listener)->fd);
         io_free(*listener);
-        return errno;
+        return error;
     }
 
     (*listener)->loop = loop;
     (*listener)->processor = io_tcp_listener_processor;
     (*listener)->e.data.ptr = (*listener);
-    (*listener)->e.events = EPOLLERR | EPOLLHUP | EPOLLRDHUP;
-    error = epoll_ctl(loop->epoll, EPOLL_CTL_ADD, (*listener)->fd, &(*listener)->e);
+    // Registered once, edge-triggered, the backlog is drained on each event
+    (*listener)->e.events = EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP | EPOLLET;
+    (*listener)->readable = 1;
+
+    if (!io_loop_uring(loop))
+    {
+        error = epoll_ctl(loop->epoll, EPOLL_CTL_ADD, (*listener)->fd, &(*listener)->e);
+    }
 
     if (!error)
     {
@@ -315,9 +555,39 @@ int io_tcp_listen(io_tcp_listener_t** listener, const char* ip, int port, int ba
     return error;
 }
 
+/*
+ * Listener sharing the port with other SO_REUSEPORT listeners, kernel
+ * spreads incoming connections between them
+ */
+int io_tcp_listen_reuseport(io_tcp_listener_t** listener, const char* ip, int port, int backlog)
+{
+    return io_tcp_listen_options(listener, ip, port, backlog, 1);
+}
+
+/*
+ * Public API
+ */
+
+int io_tcp_listen(io_tcp_listener_t** listener, const char* ip, int port, int backlog)
+{
+    return io_tcp_listen_options(listener, ip, port, backlog, 0);
+}
+
 int io_tcp_shutdown(io_tcp_listener_t* listener)
 {
-    int error = epoll_ctl(listener->loop->epoll, EPOLL_CTL_DEL, listener->fd, &listener->e);
+    int error = 0;
+
+    if (!io_loop_uring(listener->loop))
+    {
+        error = epoll_ctl(listener->loop->epoll, EPOLL_CTL_DEL, listener->fd, &listener->e);
+    }
+
+    while (listener->pending_count > 0)
+    {
+        io_close(listener->pending[listener->pending_head]);
+        listener->pending_head = (listener->pending_head + 1) % IO_TCP_ACCEPT_BATCH;
+        listener->pending_count--;
+    }
 
     io_close(listener->fd);
     listener->closed = 1;
@@ -333,59 +603,111 @@ int io_tcp_shutdown(io_tcp_listener_t* listener)
 
 int io_tcp_accept(io_stream_t** tcp, io_tcp_listener_t* listener)
 {
-    io_tcp_accept_t accept;
-    io_stream_t* stream;
+    uint64_t start = PERFORMANCE_MEASURE();
+    int error;
 
-    if (listener->error)
+    error = io_tcp_accept_status(listener);
+    if (error)
     {
-        return listener->error;
+        return error;
     }
 
-    if (listener->closed)
+#if IO_USE_URING
+    if (io_loop_uring(listener->loop))
     {
-        return ECANCELED;
+        error = io_tcp_accept_uring(listener, tcp);
+        if (!error)
+        {
+            io_tcp_accept_latency(listener, start);
+        }
+
+        return error;
     }
+#endif
 
-    if (listener->shutdown)
+    error = io_tcp_listener_wait(listener);
+    if (error)
     {
-        return ECANCELED;
+        return error;
     }
 
-    if (atomic_load64(&listener->loop->shutdown))
+    error = io_tcp_listener_pop(listener, tcp);
+    if (!error)
     {
-        listener->shutdown = 1;
-        return ECANCELED;
+        io_tcp_accept_latency(listener, start);
     }
 
-    stream = io_calloc(1, sizeof(*stream));
-    if (stream == 0)
+    return error;
+}
+
+int io_tcp_accept_many(io_tcp_listener_t* listener, io_stream_t** streams,
+                       size_t count, size_t* accepted)
+{
+    uint64_t start;
+    int error;
+
+    *accepted = 0;
+
+    if (count == 0)
     {
-        return ENOMEM;
+        return EINVAL;
     }
 
-    stream->info.type = IO_STREAM_TCP;
-    accept.task = listener->loop->current;
-    accept.tcp = stream;
-    accept.error = 0;
+#if IO_USE_URING
+    if (io_loop_uring(listener->loop))
+    {
+        error = io_tcp_accept(&streams[0], listener);
+        if (!error)
+        {
+            *accepted = 1;
+        }
 
-    listener->accept = &accept;
+        return error;
+    }
+#endif
 
-    io_loop_read_add(listener->loop, listener->fd, &listener->e);
+    start = PERFORMANCE_MEASURE();
 
-    task_suspend(accept.task);
+    error = io_tcp_accept_status(listener);
+    if (error)
+    {
+        return error;
+    }
+
+    error = io_tcp_listener_wait(listener);
+    if (error)
+    {
+        return error;
+    }
+
+    while (*accepted < count)
+    {
+        if (listener->pending_count == 0)
+        {
+            if (!listener->readable || io_tcp_listener_drain(listener) ||
+                listener->pending_count == 0)
+            {
+                break;
+            }
+        }
 
-    io_loop_read_del(listener->loop, listener->fd, &listener->e);
+        error = io_tcp_listener_pop(listener, &streams[*accepted]);
+        if (error)
+        {
+            break;
+        }
 
-    listener->accept = 0;
+        (*accepted)++;
+    }
 
-    if (accept.error)
+    if (*accepted == 0)
     {
-        io_free(stream);
-        return accept.error;
+        // Nothing taken this time, connections stay queued for the next call
+        return error ? error : EAGAIN;
     }
 
-    *tcp = stream;
-    io_stream_init(stream);
+    // One sample per call, the batch waited once
+    io_tcp_accept_latency(listener, start);
 
     return 0;
 }
@@ -400,6 +722,7 @@ int io_tcp_connect(io_stream_t** tcp, const char* ip, int port, uint64_t tmeout)
     io_stream_t* stream;
     int error = 0;
     moment_t timeout;
+    uint64_t start;
     io_loop_t* loop = io_loop_current();
 
     if (atomic_load64(&loop->shutdown))
@@ -407,12 +730,14 @@ int io_tcp_connect(io_stream_t** tcp, const char* ip, int port, uint64_t tmeout)
         return ECANCELED;
     }
 
-    stream = io_calloc(1, sizeof(*stream));
+    stream = io_loop_calloc(loop, 1, sizeof(*stream));
     if (stream == 0)
     {
         return ENOMEM;
     }
 
+    start = PERFORMANCE_MEASURE();
+
     stream->info.type = IO_STREAM_TCP;
     stream->loop = loop;
     stream->platform.processor = io_tcp_connect_processor;
@@ -449,6 +774,13 @@ int io_tcp_connect(io_stream_t** tcp, const char* ip, int port, uint64_t tmeout)
     error = io_socket_send_buffer_size(stream->fd, 0);
     error = io_tcp_nodelay(stream->fd, 1);
 
+#if IO_USE_URING
+    if (io_loop_uring(loop))
+    {
+        error = io_tcp_connect_uring(loop, stream, address, length, tmeout);
+    }
+    else
+#endif
     if (0 != connect(stream->fd, address, length))
     {
         if (errno != EINPROGRESS)
@@ -471,10 +803,10 @@ int io_tcp_connect(io_stream_t** tcp, const char* ip, int port, uint64_t tmeout)
                 {
                     if (tmeout > 0)
                     {
-                        timeout.time = time_current() + tmeout;
+                        timeout.time = loop->now + tmeout;
                         timeout.task = loop->current;
 
-                        moments_add(&loop->timeouts, &timeout);
+                        moments_add(&loop->timeouts, &timeout, loop->now);
                     }
                     else
                     {
@@ -493,16 +825,8 @@ int io_tcp_connect(io_stream_t** tcp, const char* ip, int port, uint64_t tmeout)
                         error = ETIMEDOUT;
                     }
 
-                    if (stream->info.status.closed ||
-                        stream->info.status.shutdown ||
-                        stream->info.status.error)
-                    {
-                        epoll_ctl(loop->epoll, EPOLL_CTL_DEL, stream->fd, &stream->platform.e);
-                    }
-                    else
-                    {
-                        io_loop_write_del(loop, stream->fd, &stream->platform.e);
-                    }
+                    // Connected streams are registered again on first use
+                    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, stream->fd, &stream->platform.e);
                 }
             }
         }
@@ -512,6 +836,9 @@ int io_tcp_connect(io_stream_t** tcp, const char* ip, int port, uint64_t tmeout)
         // completed immediately
     }
 
+    counter_increment(&loop->performance.tcp_connect,
+                      PERFORMANCE_NANOSECONDS(start, PERFORMANCE_MEASURE()));
+
     if (!error && stream->info.status.error)
     {
         error = stream->info.status.error;
@@ -530,13 +857,16 @@ int io_tcp_connect(io_stream_t** tcp, const char* ip, int port, uint64_t tmeout)
     if (error)
     {
         io_close(stream->fd);
-        io_free(stream);
+        io_loop_free(loop, stream);
 
         return error;
     }
 
+    // Attached by io_stream_attach on first read or write
+    stream->loop = 0;
+    stream->platform.read_req = 0;
+
     io_stream_init(stream);
-    io_loop_ref(loop);
 
     *tcp = stream;
 
@@ -229,6 +229,13 @@ int io_tcp_init()
 	return 0;
 }
 
+int io_tcp_listen_reuseport(io_tcp_listener_t** listener, const char* ip, int port, int backlog)
+{
+	// Windows has no port sharing with kernel load balancing
+	*listener = 0;
+	return ENOTSUP;
+}
+
 /*
  * Public API
  */
@@ -362,6 +369,7 @@ int io_tcp_accept(io_stream_t** stream, io_tcp_listener_t* listener)
 	DWORD sys_error;
 	int error = 0;
 	SOCKET fd;
+	uint64_t start = PERFORMANCE_MEASURE();
 
 	memset(&listener->ovl, 0, sizeof(OVERLAPPED));
 
@@ -434,9 +442,36 @@ int io_tcp_accept(io_stream_t** stream, io_tcp_listener_t* listener)
 
 	listener->accept = 0;
 
+#if IO_PERFORMANCE
+	histogram_record(&listener->loop->latency.accept,
+		PERFORMANCE_NANOSECONDS(start, PERFORMANCE_MEASURE()));
+#endif
+
 	return 0;
 }
 
+int io_tcp_accept_many(io_tcp_listener_t* listener, io_stream_t** streams,
+	size_t count, size_t* accepted)
+{
+	int error;
+
+	*accepted = 0;
+
+	if (count == 0)
+	{
+		return EINVAL;
+	}
+
+	// AcceptEx completes one socket at a time
+	error = io_tcp_accept(&streams[0], listener);
+	if (!error)
+	{
+		*accepted = 1;
+	}
+
+	return error;
+}
+
 int io_tcp_connect(io_stream_t** stream, const char* ip, int port, uint64_t tmeout)
 {
 	struct sockaddr_in addr_in;
@@ -534,10 +569,10 @@ int io_tcp_connect(io_stream_t** stream, const char* ip, int port, uint64_t tmeo
 
 	if (tmeout > 0)
 	{
-		timeout.time = time_current() + tmeout;
+		timeout.time = loop->now + tmeout;
 		timeout.task = loop->current;
 
-		moments_add(&loop->timeouts, &timeout);
+		moments_add(&loop->timeouts, &timeout, loop->now);
 	}
 	else
 	{
@@ -30,6 +30,7 @@ extern "C" {
 #include "stream.h"
 
 int io_tcp_init();
+int io_tcp_listen_reuseport(io_tcp_listener_t** listener, const char* ip, int port, int backlog);
 
 #ifdef __cplusplus
 } // extern "C"
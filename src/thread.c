@@ -39,8 +39,56 @@ int io_thread_create(thread_fn entry, void* arg)
     return 0;
 }
 
+int io_thread_cpu_count()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    return si.dwNumberOfProcessors > 0 ? (int)si.dwNumberOfProcessors : 1;
+}
+
+int io_thread_set_affinity(int cpu)
+{
+    if (cpu < 0 || cpu >= (int)(sizeof(DWORD_PTR) * 8))
+    {
+        return EINVAL;
+    }
+
+    if (0 == SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+    {
+        return EINVAL;
+    }
+
+    return 0;
+}
+
+int io_thread_cpu_at(int index)
+{
+    DWORD_PTR process;
+    DWORD_PTR system;
+    int cpu;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process, &system))
+    {
+        return -1;
+    }
+
+    for (cpu = 0; cpu < (int)(sizeof(DWORD_PTR) * 8); ++cpu)
+    {
+        if ((process & ((DWORD_PTR)1 << cpu)) && index-- == 0)
+        {
+            return cpu;
+        }
+    }
+
+    return -1;
+}
+
 #else
 #   include <pthread.h>
+#   include <sched.h>
+#   include <unistd.h>
+#   include <errno.h>
 
 int io_thread_create(thread_fn entry, void* arg)
 {
@@ -48,4 +96,53 @@ int io_thread_create(thread_fn entry, void* arg)
     return pthread_create(&handle, 0, entry, arg);
 }
 
+int io_thread_cpu_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (int)count : 1;
+}
+
+int io_thread_set_affinity(int cpu)
+{
+#if PLATFORM_LINUX
+    cpu_set_t set;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        return EINVAL;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    return ENOTSUP;
+#endif
+}
+
+int io_thread_cpu_at(int index)
+{
+#if PLATFORM_LINUX
+    cpu_set_t set;
+    int cpu;
+
+    if (0 != sched_getaffinity(0, sizeof(set), &set))
+    {
+        return -1;
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &set) && index-- == 0)
+        {
+            return cpu;
+        }
+    }
+#endif
+
+    return -1;
+}
+
 #endif
\ No newline at end of file
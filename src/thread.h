@@ -26,6 +26,7 @@
 extern "C" {
 #endif
 
+#include <stdint.h> // uint64_t
 #include "platform.h"
 
 #if PLATFORM_WINDOWS
@@ -73,14 +74,26 @@ static FORCEINLINE void io_condition_signal(io_condition_t* condition)
     WakeConditionVariable(condition);
 }
 
+static FORCEINLINE void io_condition_broadcast(io_condition_t* condition)
+{
+    WakeAllConditionVariable(condition);
+}
+
 static FORCEINLINE void io_condition_wait(io_condition_t* condition, io_mutex_t* mutex)
 {
     SleepConditionVariableCS(condition, mutex, INFINITE);
 }
 
+static FORCEINLINE void io_condition_wait_timeout(io_condition_t* condition, io_mutex_t* mutex,
+                                                  uint64_t milliseconds)
+{
+    SleepConditionVariableCS(condition, mutex, (DWORD)milliseconds);
+}
+
 #else
 
 #   include <pthread.h>
+#   include <time.h> // clock_gettime
 #   define IO_THREAD_FN(fn) void* (*fn)
 #	define IO_THREAD_TYPE void*
 
@@ -122,16 +135,42 @@ static FORCEINLINE void io_condition_signal(io_condition_t* condition)
     pthread_cond_signal(condition);
 }
 
+static FORCEINLINE void io_condition_broadcast(io_condition_t* condition)
+{
+    pthread_cond_broadcast(condition);
+}
+
 static FORCEINLINE void io_condition_wait(io_condition_t* condition, io_mutex_t* mutex)
 {
     pthread_cond_wait(condition, mutex);
 }
 
+static FORCEINLINE void io_condition_wait_timeout(io_condition_t* condition, io_mutex_t* mutex,
+                                                  uint64_t milliseconds)
+{
+    struct timespec deadline;
+
+    // Condition variables measure against the realtime clock by default
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += milliseconds / 1000;
+    deadline.tv_nsec += (milliseconds % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(condition, mutex, &deadline);
+}
+
 #endif
 
 typedef IO_THREAD_FN(thread_fn)(void* arg);
 
 int io_thread_create(thread_fn entry, void* arg);
+int io_thread_cpu_count(); // online processors, at least 1
+int io_thread_set_affinity(int cpu); // pins the calling thread
+int io_thread_cpu_at(int index); // index-th processor the process may run on, -1 if none
 
 #ifdef __cplusplus
 } // extern "C"
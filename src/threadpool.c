@@ -57,12 +57,18 @@ IO_THREAD_TYPE io_threadpool_worker(void* arg)
 
         io_mutex_lock(&threadpool.mutex);
 
-        while (threadpool.head == 0) {
+        while (threadpool.head == 0 && !atomic_load64(&threadpool.shutdown)) {
             threadpool.idle_threads += 1;
             io_condition_wait(&threadpool.condition, &threadpool.mutex);
             threadpool.idle_threads -= 1;
         }
 
+        if (threadpool.head == 0)
+        {
+            io_mutex_unlock(&threadpool.mutex);
+            break;
+        }
+
         work = LIST_HEAD((&threadpool));
         LIST_POP_HEAD((&threadpool));
 
@@ -97,13 +103,15 @@ int io_threadpool_init()
 
 int io_threadpool_shutdown()
 {
+    io_mutex_lock(&threadpool.mutex);
     atomic_store64(&threadpool.shutdown, 1);
+    io_condition_broadcast(&threadpool.condition);
+    io_mutex_unlock(&threadpool.mutex);
 
     // ToDo: Wait for threads
     // ToDo: notify works about shutdown
 
-    io_condition_destroy(&threadpool.condition);
-    io_mutex_destroy(&threadpool.mutex);
+    // Workers are not joined, condition and mutex stay alive for them
 
     return 1;
 }
@@ -113,6 +121,8 @@ int io_threadpool_post(io_work_t* work)
     work->loop = io_loop_current();
     work->task = work->loop->current;
 
+    counter_increment(&work->loop->performance.threadpool_post, 0);
+
     io_mutex_lock(&threadpool.mutex);
 
     LIST_PUSH_TAIL((&threadpool), work)
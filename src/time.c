@@ -69,5 +69,40 @@ uint64_t time_current()
 
     return (uint64_t)((tv.tv_sec * 1000ul) + (tv.tv_usec / 1000ul));
 
+#endif
+}
+
+uint64_t time_monotonic()
+{
+#if PLATFORM_WINDOWS
+
+    return GetTickCount64();
+
+#elif PLATFORM_MACOSX
+
+    clock_serv_t cclock;
+    mach_timespec_t mts;
+    host_get_clock_service(mach_host_self(), SYSTEM_CLOCK, &cclock);
+    clock_get_time(cclock, &mts);
+    mach_port_deallocate(mach_task_self(), cclock);
+
+    return ((uint64_t)mts.tv_sec * THOUSAND) + (mts.tv_nsec / MILLION);
+
+#else
+
+    struct timespec ts;
+
+#   if IO_COARSE_CLOCK && defined(CLOCK_MONOTONIC_COARSE)
+    // Jiffy resolution, several times cheaper to read
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) != 0)
+#   else
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+#   endif
+    {
+        return 0;
+    }
+
+    return ((uint64_t)ts.tv_sec * THOUSAND) + (ts.tv_nsec / MILLION);
+
 #endif
 }
\ No newline at end of file
@@ -28,7 +28,8 @@ extern "C" {
 
 #include <stdint.h> // uint64_t
 
-uint64_t time_current();
+uint64_t time_current();   // wall clock milliseconds
+uint64_t time_monotonic(); // milliseconds since unspecified point, never jumps
 
 #ifdef __cplusplus
 } // extern "C"
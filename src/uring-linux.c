@@ -0,0 +1,349 @@
+/* Copyright (c) 2018, Artak Khnkoyan <artak.khnkoyan@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "platform.h"
+
+#if IO_USE_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "loop.h"
+#include "moment.h"
+#include "task.h"
+#include "time.h"
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int io_uring_submit(io_uring_t* uring)
+{
+    int submitted;
+
+    while (uring->pending > 0)
+    {
+        submitted = io_uring_enter(uring->fd, uring->pending, 0, 0);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // EAGAIN/EBUSY: kernel is short on resources, retry next iteration
+            return errno;
+        }
+
+        uring->pending -= submitted;
+    }
+
+    return 0;
+}
+
+static int io_uring_complete(io_uring_t* uring)
+{
+    struct io_uring_cqe* cqe;
+    io_uring_req_t* req;
+    unsigned head;
+    int count = 0;
+
+    head = *uring->cq.head;
+    while (head != __atomic_load_n(uring->cq.tail, __ATOMIC_ACQUIRE))
+    {
+        cqe = &uring->cq.cqes[head & *uring->cq.mask];
+        req = (io_uring_req_t*)(uintptr_t)cqe->user_data;
+
+        if (req != 0)
+        {
+            req->result = cqe->res;
+            req->done = 1;
+        }
+
+        // Release entry before resuming, resumed task may complete others
+        ++head;
+        __atomic_store_n(uring->cq.head, head, __ATOMIC_RELEASE);
+
+        if (req != 0)
+        {
+            task_resume(req->task);
+            ++count;
+        }
+
+        head = *uring->cq.head;
+    }
+
+    return count;
+}
+
+/*
+ * Internal API
+ */
+
+int io_uring_init(io_uring_t* uring, int eventfd)
+{
+    struct io_uring_params params;
+    void* ring;
+    int error;
+
+    memset(uring, 0, sizeof (*uring));
+    memset(&params, 0, sizeof (params));
+
+    uring->fd = io_uring_setup(IO_URING_ENTRIES, &params);
+    if (uring->fd == -1)
+    {
+        return errno;
+    }
+
+    uring->sq.ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    uring->cq.ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    uring->sq.sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (uring->cq.ring_size > uring->sq.ring_size)
+            uring->sq.ring_size = uring->cq.ring_size;
+
+        uring->cq.ring_size = 0;
+    }
+
+    ring = mmap(0, uring->sq.ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+    {
+        goto failed;
+    }
+
+    uring->sq.ring = ring;
+
+    if (uring->cq.ring_size == 0)
+    {
+        uring->cq.ring = ring;
+    }
+    else
+    {
+        ring = mmap(0, uring->cq.ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+        if (ring == MAP_FAILED)
+        {
+            goto failed;
+        }
+
+        uring->cq.ring = ring;
+    }
+
+    uring->sq.sqes = mmap(0, uring->sq.sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sq.sqes == MAP_FAILED)
+    {
+        uring->sq.sqes = 0;
+        goto failed;
+    }
+
+    uring->sq.head = (unsigned*)((char*)uring->sq.ring + params.sq_off.head);
+    uring->sq.tail = (unsigned*)((char*)uring->sq.ring + params.sq_off.tail);
+    uring->sq.mask = (unsigned*)((char*)uring->sq.ring + params.sq_off.ring_mask);
+    uring->sq.entries = (unsigned*)((char*)uring->sq.ring + params.sq_off.ring_entries);
+    uring->sq.array = (unsigned*)((char*)uring->sq.ring + params.sq_off.array);
+
+    uring->cq.head = (unsigned*)((char*)uring->cq.ring + params.cq_off.head);
+    uring->cq.tail = (unsigned*)((char*)uring->cq.ring + params.cq_off.tail);
+    uring->cq.mask = (unsigned*)((char*)uring->cq.ring + params.cq_off.ring_mask);
+    uring->cq.cqes = (struct io_uring_cqe*)((char*)uring->cq.ring + params.cq_off.cqes);
+
+    // Completions wake the loop the same way cross thread posts do
+    if (0 != io_uring_register(uring->fd, IORING_REGISTER_EVENTFD, &eventfd, 1))
+    {
+        goto failed;
+    }
+
+    return 0;
+
+failed:
+
+    error = errno;
+    io_uring_cleanup(uring);
+    return error;
+}
+
+void io_uring_cleanup(io_uring_t* uring)
+{
+    if (uring->sq.sqes != 0)
+        munmap(uring->sq.sqes, uring->sq.sqes_size);
+
+    if (uring->cq.ring != 0 && uring->cq.ring != uring->sq.ring)
+        munmap(uring->cq.ring, uring->cq.ring_size);
+
+    if (uring->sq.ring != 0)
+        munmap(uring->sq.ring, uring->sq.ring_size);
+
+    if (uring->fd != -1)
+        close(uring->fd);
+
+    memset(uring, 0, sizeof (*uring));
+    uring->fd = -1;
+}
+
+void io_uring_process(io_loop_t* loop)
+{
+    io_uring_t* uring = &loop->uring;
+
+    if (uring->fd == -1)
+    {
+        return;
+    }
+
+    do
+    {
+        if (io_uring_submit(uring))
+        {
+            break;
+        }
+
+        // Completions resume tasks which may arm new timeouts
+        io_loop_update_time(loop);
+    }
+    while (io_uring_complete(uring) > 0 && uring->pending > 0);
+}
+
+int io_uring_flush(io_loop_t* loop)
+{
+    if (loop->uring.fd == -1)
+    {
+        return 0;
+    }
+
+    return io_uring_submit(&loop->uring);
+}
+
+struct io_uring_sqe* io_uring_sqe_get(io_loop_t* loop)
+{
+    io_uring_t* uring = &loop->uring;
+    struct io_uring_sqe* sqe;
+    unsigned tail = *uring->sq.tail;
+    unsigned index;
+
+    while (tail - __atomic_load_n(uring->sq.head, __ATOMIC_ACQUIRE) >= *uring->sq.entries)
+    {
+        // Ring is full, hand prepared entries over to the kernel
+        if (io_uring_submit(uring))
+        {
+            return 0;
+        }
+    }
+
+    index = tail & *uring->sq.mask;
+    sqe = &uring->sq.sqes[index];
+    memset(sqe, 0, sizeof (*sqe));
+
+    uring->sq.array[index] = index;
+    __atomic_store_n(uring->sq.tail, tail + 1, __ATOMIC_RELEASE);
+    uring->pending += 1;
+
+    return sqe;
+}
+
+int io_uring_sqe_wait(io_loop_t* loop, struct io_uring_sqe* sqe,
+                      uint64_t timeout, int* timedout)
+{
+    io_uring_req_t req;
+    struct io_uring_sqe* cancel;
+    moment_t moment;
+
+    req.task = loop->current;
+    req.result = 0;
+    req.done = 0;
+
+    sqe->user_data = (uint64_t)(uintptr_t)&req;
+
+    if (timeout > 0)
+    {
+        moment.time = loop->now + timeout;
+        moment.task = loop->current;
+
+        moments_add(&loop->timeouts, &moment, loop->now);
+    }
+    else
+    {
+        moment.time = 0;
+    }
+
+    task_suspend(req.task);
+
+    if (moment.time > 0 && !moment.reached)
+    {
+        moments_remove(&loop->timeouts, &moment);
+    }
+
+    if (timedout)
+    {
+        *timedout = (moment.time > 0 && moment.reached && !req.done);
+    }
+
+    if (!req.done)
+    {
+        // Timed out, the entry still references caller buffers
+        while (!req.done && (cancel = io_uring_sqe_get(loop)) == 0)
+        {
+            // Kernel short on resources, the loop reaps completions meanwhile
+            moment.time = loop->now + 1;
+            moment.task = loop->current;
+
+            moments_add(&loop->timeouts, &moment, loop->now);
+            task_suspend(req.task);
+
+            if (!moment.reached)
+            {
+                moments_remove(&loop->timeouts, &moment);
+            }
+        }
+
+        if (!req.done)
+        {
+            // Cancels files and pipes as well as sockets
+            cancel->opcode = IORING_OP_ASYNC_CANCEL;
+            cancel->addr = (uint64_t)(uintptr_t)&req;
+
+            // Left pending on failure, the loop submits before it blocks
+            io_uring_flush(loop);
+        }
+
+        while (!req.done)
+        {
+            task_suspend(req.task);
+        }
+    }
+
+    return req.result;
+}
+
+#endif // IO_USE_URING
\ No newline at end of file
@@ -0,0 +1,102 @@
+/* Copyright (c) 2018, Artak Khnkoyan <artak.khnkoyan@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef IO_URING_LINUX_H_INCLUDED
+#define IO_URING_LINUX_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h> // uint64_t
+#include <stddef.h> // size_t
+#include <linux/io_uring.h>
+
+#define IO_URING_ENTRIES 1024
+#define IO_URING_MAX_LENGTH 0x7ffff000u // MAX_RW_COUNT
+
+struct io_loop_t;
+struct task_t;
+
+/*
+ * Submission/completion rings shared with the kernel. Completions are
+ * signaled through the loop wakeup eventfd, so epoll_wait stays the only
+ * blocking call of the loop.
+ */
+typedef struct io_uring_t {
+    int fd;
+    unsigned pending; // prepared, not yet submitted entries
+    struct {
+        unsigned* head;
+        unsigned* tail;
+        unsigned* mask;
+        unsigned* entries;
+        unsigned* array;
+        struct io_uring_sqe* sqes;
+        void* ring;
+        size_t ring_size;
+        size_t sqes_size;
+    } sq;
+    struct {
+        unsigned* head;
+        unsigned* tail;
+        unsigned* mask;
+        struct io_uring_cqe* cqes;
+        void* ring;
+        size_t ring_size;
+    } cq;
+} io_uring_t;
+
+typedef struct io_uring_req_t {
+    struct task_t* task;
+    int result;
+    int done;
+} io_uring_req_t;
+
+int io_uring_init(io_uring_t* uring, int eventfd);
+void io_uring_cleanup(io_uring_t* uring);
+void io_uring_process(struct io_loop_t* loop);
+
+/*
+ * Hands prepared entries over to the kernel, called before the loop blocks
+ * since completions are the only thing that wake it
+ */
+int io_uring_flush(struct io_loop_t* loop);
+
+/*
+ * Returns zeroed submission entry, flushes the ring when it is full
+ */
+struct io_uring_sqe* io_uring_sqe_get(struct io_loop_t* loop);
+
+/*
+ * Suspends current task until the entry completes or timeout (milliseconds)
+ * is reached. Timed out entries are cancelled and waited for, so buffers
+ * referenced by the entry may live on the task stack.
+ * Returns completion result (negative errno on failure).
+ */
+int io_uring_sqe_wait(struct io_loop_t* loop, struct io_uring_sqe* sqe,
+                      uint64_t timeout, int* timedout);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // IO_URING_LINUX_H_INCLUDED
\ No newline at end of file
@@ -0,0 +1,271 @@
+/* Copyright (c) 2018, Artak Khnkoyan <artak.khnkoyan@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include "io.h"
+#include "atomic.h"
+#include "thread.h"
+#include "time.h"
+#include "watchdog.h"
+
+// Stalls reported per check, the rest wait for the next one
+#define IO_WATCHDOG_REPORTS 64
+
+typedef enum io_watchdog_state_t {
+    IO_WATCHDOG_STOPPED,
+    IO_WATCHDOG_RUNNING,
+    IO_WATCHDOG_STOPPING
+} io_watchdog_state_t;
+
+typedef struct io_watchdog_t {
+    io_watchdog_state_t state;
+    uint64_t threshold;     // milliseconds
+    uint64_t interval;      // milliseconds between checks
+    io_watchdog_fn fn;
+    void* arg;
+    int initialized;
+    io_mutex_t mutex;
+    io_condition_t condition;
+} io_watchdog_t;
+
+static io_watchdog_t watchdog;
+
+/*
+ * Running loops. The lock is only held for short list walks, a spin lock
+ * needs no initialization
+ */
+static atomic64_t registry_lock;
+static io_loop_t* registry_head;
+
+static void io_watchdog_registry_lock()
+{
+    while (!atomic_cas64(&registry_lock, 0, 1))
+    {
+        // Spin
+    }
+}
+
+static void io_watchdog_registry_unlock()
+{
+    atomic_store64(&registry_lock, 0);
+}
+
+/*
+ * A loop stalls when it stays out of waiting for events, that is its beat
+ * is even and unchanged, for longer than the threshold. Each stall is
+ * reported once, the running task is read without synchronization and may
+ * have finished meanwhile
+ */
+static size_t io_watchdog_check(io_stall_t* stalls, size_t limit, uint64_t now)
+{
+    io_loop_t* loop;
+    task_t* task;
+    uint64_t beat;
+    uint64_t busy_since;
+    size_t count = 0;
+
+    io_watchdog_registry_lock();
+
+    for (loop = registry_head; loop != 0 && count < limit; loop = loop->watched_next)
+    {
+        beat = atomic_load64(&loop->beat);
+        if ((beat & 1) != 0 || beat + 1 == loop->beat_reported)
+        {
+            continue;
+        }
+
+        // Cached right before the beat turned even
+        busy_since = loop->now;
+        if (now < busy_since + watchdog.threshold)
+        {
+            continue;
+        }
+
+        loop->beat_reported = beat + 1;
+
+        task = loop->current;
+
+        stalls[count].loop = loop;
+        stalls[count].milliseconds = now - busy_since;
+        stalls[count].entry = (task != 0 && task != &loop->main) ? task->entry : 0;
+        stalls[count].arg = (task != 0 && task != &loop->main) ? task->arg : 0;
+        count++;
+    }
+
+    io_watchdog_registry_unlock();
+
+    return count;
+}
+
+static IO_THREAD_TYPE io_watchdog_thread(void* arg)
+{
+    io_stall_t stalls[IO_WATCHDOG_REPORTS];
+    size_t count;
+    size_t i;
+
+    (void)arg;
+
+    io_mutex_lock(&watchdog.mutex);
+
+    while (watchdog.state == IO_WATCHDOG_RUNNING)
+    {
+        io_condition_wait_timeout(&watchdog.condition, &watchdog.mutex, watchdog.interval);
+
+        if (watchdog.state != IO_WATCHDOG_RUNNING)
+        {
+            break;
+        }
+
+        io_mutex_unlock(&watchdog.mutex);
+
+        // Reported outside of the locks, the callback may take its time
+        count = io_watchdog_check(stalls, IO_WATCHDOG_REPORTS, time_monotonic());
+        for (i = 0; i < count; ++i)
+        {
+            watchdog.fn(&stalls[i], watchdog.arg);
+        }
+
+        io_mutex_lock(&watchdog.mutex);
+    }
+
+    watchdog.state = IO_WATCHDOG_STOPPED;
+    io_condition_broadcast(&watchdog.condition);
+
+    io_mutex_unlock(&watchdog.mutex);
+
+    return 0;
+}
+
+/*
+ * Internal API
+ */
+
+void io_watchdog_register(io_loop_t* loop)
+{
+    io_watchdog_registry_lock();
+
+    loop->watched_next = registry_head;
+    registry_head = loop;
+
+    io_watchdog_registry_unlock();
+}
+
+void io_watchdog_unregister(io_loop_t* loop)
+{
+    io_loop_t** link;
+
+    io_watchdog_registry_lock();
+
+    for (link = &registry_head; *link != 0; link = &(*link)->watched_next)
+    {
+        if (*link == loop)
+        {
+            *link = loop->watched_next;
+            break;
+        }
+    }
+
+    loop->watched_next = 0;
+
+    io_watchdog_registry_unlock();
+}
+
+/*
+ * Public API
+ */
+
+int io_watchdog_start(uint64_t threshold, io_watchdog_fn fn, void* arg)
+{
+    int error;
+
+    if (threshold == 0 || fn == 0)
+    {
+        return EINVAL;
+    }
+
+    // Mutex and condition live for the process, a stopped thread may
+    // still be releasing them
+    io_watchdog_registry_lock();
+
+    if (!watchdog.initialized)
+    {
+        io_mutex_init(&watchdog.mutex);
+        io_condition_init(&watchdog.condition);
+        watchdog.initialized = 1;
+    }
+
+    io_watchdog_registry_unlock();
+
+    io_mutex_lock(&watchdog.mutex);
+
+    if (watchdog.state != IO_WATCHDOG_STOPPED)
+    {
+        io_mutex_unlock(&watchdog.mutex);
+        return EBUSY;
+    }
+
+    watchdog.threshold = threshold;
+    watchdog.interval = threshold / 4 > 0 ? threshold / 4 : 1;
+    watchdog.fn = fn;
+    watchdog.arg = arg;
+    watchdog.state = IO_WATCHDOG_RUNNING;
+
+    error = io_thread_create(io_watchdog_thread, 0);
+    if (error)
+    {
+        watchdog.state = IO_WATCHDOG_STOPPED;
+    }
+
+    io_mutex_unlock(&watchdog.mutex);
+
+    return error;
+}
+
+int io_watchdog_stop()
+{
+    io_watchdog_registry_lock();
+
+    if (!watchdog.initialized)
+    {
+        io_watchdog_registry_unlock();
+        return 0;
+    }
+
+    io_watchdog_registry_unlock();
+
+    io_mutex_lock(&watchdog.mutex);
+
+    if (watchdog.state == IO_WATCHDOG_RUNNING)
+    {
+        watchdog.state = IO_WATCHDOG_STOPPING;
+        io_condition_broadcast(&watchdog.condition);
+    }
+
+    // No reports after return
+    while (watchdog.state != IO_WATCHDOG_STOPPED)
+    {
+        io_condition_wait(&watchdog.condition, &watchdog.mutex);
+    }
+
+    io_mutex_unlock(&watchdog.mutex);
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,211 @@
+/* Copyright (c) 2018, Artak Khnkoyan <artak.khnkoyan@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Server running out of descriptors keeps serving: the client process holds
+ * more connections open than the server may have descriptors, lets them go
+ * and expects an answer on a fresh one
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../include/io.h"
+
+#define PORT_BASE 18000
+#define SERVER_FILES 64
+#define CLIENT_CONNECTIONS 256
+
+static uint64_t retries;
+static int port;
+
+static void on_connection(io_loop_t* loop, io_stream_t* stream)
+{
+    io_stats_t stats;
+    char buffer[16];
+    size_t length;
+
+    length = io_stream_read(stream, buffer, 4, 1);
+
+    if (length == 4 && memcmp(buffer, "quit", 4) == 0)
+    {
+        if (io_stats_get(loop, &stats) == 0)
+        {
+            retries = stats.tcp_accept_retry.count;
+        }
+
+        io_stream_write(stream, "bye!", 4);
+        io_stream_close(stream);
+        io_loop_stop(loop);
+        return;
+    }
+
+    io_stream_close(stream);
+}
+
+static int client_connect()
+{
+    struct sockaddr_in address;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    address.sin_port = htons(port);
+
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int client()
+{
+    int fds[CLIENT_CONNECTIONS];
+    char buffer[4];
+    int attempt;
+    int fd;
+    int i;
+
+    for (i = 0; i < CLIENT_CONNECTIONS; ++i)
+    {
+        fds[i] = -1;
+
+        for (attempt = 0; attempt < 100 && fds[i] == -1; ++attempt)
+        {
+            fds[i] = client_connect();
+            if (fds[i] == -1)
+            {
+                usleep(10000);
+            }
+        }
+
+        if (fds[i] == -1)
+        {
+            printf("client: connect %d: %s\n", i, strerror(errno));
+            return 1;
+        }
+    }
+
+    // Let the server hit the limit before any descriptor comes back
+    usleep(200000);
+
+    for (i = 0; i < CLIENT_CONNECTIONS; ++i)
+    {
+        close(fds[i]);
+    }
+
+    fd = client_connect();
+    if (fd == -1)
+    {
+        printf("client: connect: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (write(fd, "quit", 4) != 4 ||
+        recv(fd, buffer, sizeof(buffer), MSG_WAITALL) != 4 ||
+        memcmp(buffer, "bye!", 4) != 0)
+    {
+        printf("client: no answer after the server ran out of descriptors\n");
+        close(fd);
+        return 1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+int main()
+{
+    struct rlimit limit;
+    pid_t pid;
+    int status;
+    int error;
+
+    // Ports of a previous run may still linger in TIME_WAIT
+    port = PORT_BASE + getpid() % 10000;
+
+    pid = fork();
+    if (pid == -1)
+    {
+        printf("fork: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (pid == 0)
+    {
+        alarm(30);
+        _exit(client());
+    }
+
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = SERVER_FILES;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        printf("setrlimit: %s\n", strerror(errno));
+        kill(pid, SIGKILL);
+        return 1;
+    }
+
+    alarm(30);
+
+    error = io_tcp_serve("127.0.0.1", port, CLIENT_CONNECTIONS, 1, (io_loop_fn)on_connection);
+    if (error)
+    {
+        printf("serve: %s\n", strerror(error));
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return 1;
+    }
+
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return 1;
+    }
+
+#if !defined(IO_PERFORMANCE) || IO_PERFORMANCE
+    if (retries == 0)
+    {
+        printf("server never ran out of descriptors\n");
+        return 1;
+    }
+#endif
+
+    printf("ok, %llu accept retries\n", (unsigned long long)retries);
+    return 0;
+}
\ No newline at end of file